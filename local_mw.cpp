@@ -1,17 +1,59 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <future>
 #include <iomanip>
 #include <iostream>
+#include <map>
 #include <mutex>
+#include <queue>
+#include <set>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <vector>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#endif
+
+// macOS has no MSG_NOSIGNAL; SIGPIPE is ignored instead where it matters
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+extern char **environ;
+
 namespace fs = std::filesystem;
 
 // Version is injected at compile time via -DAPP_VERSION
@@ -25,12 +67,73 @@ const std::string SOURCE_URL =
 bool g_verbose = false;
 bool g_reportOnly = false;
 bool g_autoYes = false;
+bool g_readOnly = false;
 bool g_updateMode = false;
 std::string g_updateType;
 std::string g_updateName;
 std::string g_reportFile;
+// Prometheus text file written after every run (--metrics-file)
+std::string g_metricsFile;
+int g_changelogLimit = 0;
+bool g_nested = false;
+std::vector<std::string> g_scanRoots;
+bool g_daemon = false;
+std::string g_listenSocket;
+int g_sweepInterval = 3600;
+std::string g_notifySocket;
+std::string g_notifyTarget;
+std::string g_notifyRef;
+std::string g_stateDir;
+bool g_adaptive = false;
+int g_fetchBudget = 0;
+bool g_hedge = false;
+std::string g_sparseProfile;
+std::string g_migrationRules;
+std::vector<std::string> g_replicaPaths;
+bool g_replicateHardlinks = false;
+bool g_compatCheck = true;
+// How checkouts are updated: "pull" (plain git pull), "autostash" or
+// "rebase"; --strategy-rules overrides it per repository
+std::string g_updateStrategy = "pull";
+bool g_fingerprint = false;
+bool g_progressDisplay = true;
+// Read refs and HEAD straight from .git instead of asking git
+bool g_native = true;
+// Output columns chosen with --columns (empty for the full table) and the
+// --only row filter; together they decide which checks run at all
+std::vector<std::string> g_columns;
+std::string g_onlyFilter;
+bool g_needFetch = true;
+bool g_needDirty = true;
+bool g_needStaleness = true;
+// Worker processes to split a run across (1 runs everything in-process)
+int g_shards = 1;
+bool g_staged = false;
+// Report what an update would do and how long it would take (--plan)
+bool g_plan = false;
+int g_waveSize = 10;
+std::string g_healthCommand;
+bool g_verify = false;
+// Read rate limit for --verify in MB per second (0 is unlimited)
+int g_ioBudget = 0;
+// MediaWiki version of the installation, read once before scanning
+std::string g_coreVersion;
 std::mutex g_coutMutex;
 
+/**
+ * Get the current local time as "YYYY-MM-DD HH:MM:SS"
+ *
+ * @return The formatted timestamp
+ */
+std::string currentTimestamp() {
+  std::time_t now = std::time(nullptr);
+  std::tm *localTime = std::localtime(&now);
+  char timeBuffer[20];
+  std::strftime(timeBuffer, sizeof(timeBuffer), "%Y-%m-%d %H:%M:%S",
+                localTime);
+  return timeBuffer;
+}
+
 /**
  * Log a verbose message (thread-safe)
  *
@@ -75,6 +178,19 @@ bool promptForConfirmation(const std::string &message) {
   return !response.empty() && (response[0] == 'y' || response[0] == 'Y');
 }
 
+// Why a git command failed, judged from its exit status and known messages
+enum class GitFailure {
+  None,
+  LockContention,
+  Network,
+  Auth,
+  NotFound,
+  NonFastForward,
+  LocalChanges,
+  DiskFull,
+  Other
+};
+
 struct RepoStatus {
   std::string name;
   std::string type;
@@ -86,31 +202,191 @@ struct RepoStatus {
   bool pulled;
   bool hadUncommittedChanges;
   std::string pullError;
+  std::vector<std::string> changelog;
+  bool lockContention = false;
+  fs::path path;
+  // Object ids of HEAD and origin/<branch> after fetching, if known
+  std::string headOid;
+  std::string upstreamOid;
+  // MediaWiki requirement of the upstream manifest, and whether the
+  // installed core fails it (which blocks the pull)
+  std::string upstreamVersion;
+  std::string requiresMediaWiki;
+  bool incompatible = false;
+  // Set when --verify found a damaged pack or loose object
+  bool corrupted = false;
+  // HEAD after a successful pull (headOid is HEAD before it)
+  std::string pulledOid;
+  // Whether behindBy was reused because neither HEAD nor upstream moved
+  bool behindCached = false;
+  // Upstream commits per day, or negative if unknown
+  double commitsPerDay = -1;
+  // Learned fetch interval in seconds, or 0 if not scheduled
+  int fetchInterval = 0;
+  // Whether a "not a repository" or branch error was reused from an
+  // earlier run because the directory has not changed since
+  bool negativeCached = false;
+  // Committer times (Unix seconds) of the oldest upstream commit missing
+  // from HEAD and of HEAD itself, or 0 if unknown
+  long long oldestMissingTime = 0;
+  long long headCommitTime = 0;
+  // Files changed between HEAD and its upstream, or -1 if not counted
+  int incomingFiles = -1;
+  // Incoming non-merge commits, of which changelog lists the newest
+  int changelogTotal = 0;
+  // Why the fetch failed, if it did
+  GitFailure fetchFailure = GitFailure::None;
+};
+
+struct RepoTarget {
+  fs::path path;
+  std::string type;
+  // Display name; defaults to the directory name when empty
+  std::string name;
+};
+
+// Directory names never descended into while discovering nested repositories
+const std::vector<std::string> DISCOVERY_PRUNED_DIRS = {
+    ".git", ".svn", ".hg", "node_modules", "bower_components", "cache"};
+// Maximum directory depth below a discovery root
+const int DISCOVERY_MAX_DEPTH = 8;
+
+// Window of upstream history used to learn a repository's commit rate, and
+// how long a learned rate is trusted before it is measured again
+const int RATE_WINDOW_DAYS = 30;
+const int RATE_REFRESH_SECONDS = 24 * 60 * 60;
+// Bounds on learned per-repository fetch intervals, in seconds
+const int MIN_FETCH_INTERVAL = 5 * 60;
+const int MAX_FETCH_INTERVAL = 24 * 60 * 60;
+// Fields of a repository's row in the "phases" state table: smoothed
+// seconds per fetch, per update and per health check (kept on core's row),
+// and the files changed by the updates that were timed
+const size_t PHASE_FETCH = 0;
+const size_t PHASE_UPDATE = 1;
+const size_t PHASE_UPDATE_FILES = 2;
+const size_t PHASE_HEALTH = 3;
+// The same for updates that took the large fast-forward path (each time is
+// followed by its file count)
+const size_t PHASE_LARGE_UPDATE = 4;
+const size_t PHASE_LARGE_UPDATE_FILES = 5;
+// What --plan assumes for phases a repository has no timings for
+const double DEFAULT_FETCH_SECONDS = 2.0;
+const double DEFAULT_UPDATE_SECONDS = 0.5;
+const double DEFAULT_UPDATE_SECONDS_PER_FILE = 0.01;
+const double DEFAULT_HEALTH_SECONDS = 5.0;
+// Fast-forwards changing at least this many files write the new files with
+// parallel checkout workers before the old ones are removed
+const int LARGE_FASTFORWARD_FILES = 1000;
+// Most commits read while looking for the oldest commit missing from HEAD
+const int STALENESS_MAX_COMMITS = 5000;
+
+// Fetch latency samples kept per git host, and how many are needed before
+// hedging starts for that host
+const size_t LATENCY_SAMPLES_KEPT = 64;
+const size_t MIN_LATENCY_SAMPLES = 8;
+// At most one fetch in HEDGE_BUDGET_RATIO may be hedged, and at most
+// MAX_CONCURRENT_HEDGES hedges may run at once
+const int HEDGE_BUDGET_RATIO = 10;
+const int MAX_CONCURRENT_HEDGES = 4;
+
+// Largest notification request the daemon will read, in bytes
+const size_t MAX_REQUEST_BYTES = 64 * 1024;
+
+// Unit in which --verify reads and charges the I/O budget, in bytes
+const size_t VERIFY_CHUNK_BYTES = 1024 * 1024;
+
+// Attempts made when another git process holds a repository lock, and the
+// initial backoff between them (doubled after every attempt)
+const int LOCK_RETRY_ATTEMPTS = 4;
+const int LOCK_RETRY_BASE_MS = 250;
+
+// Attempts made when a fetch or pull fails on a transient (network) error,
+// and the initial delay between them (doubled after every attempt)
+const int TRANSIENT_RETRY_ATTEMPTS = 3;
+const int TRANSIENT_RETRY_BASE_MS = 1000;
+// How long the daemon leaves a repository alone after a permanent fetch
+// failure: doubled for every repeat, up to the maximum
+const int PERMANENT_BACKOFF_SECONDS = 15 * 60;
+const int MAX_PERMANENT_BACKOFF_SECONDS = 24 * 60 * 60;
+
+#ifdef __APPLE__
+// macOS has no pipe2(): a pipe is only marked close-on-exec after it is
+// created, so no process may be started in between
+std::mutex g_spawnMutex;
+#endif
+
+// Held while starting a process; only does anything without pipe2()
+struct SpawnLock {
+#ifdef __APPLE__
+  std::lock_guard<std::mutex> lock{g_spawnMutex};
+#endif
 };
 
+/**
+ * Create a pipe whose ends are not inherited by processes started later,
+ * so a child's copy of the write end can never hold off end-of-file
+ *
+ * @param fds Receives the read and write ends
+ * @return true if the pipe was created
+ */
+bool openPipe(int fds[2]) {
+#ifdef __APPLE__
+  std::lock_guard<std::mutex> lock(g_spawnMutex);
+  if (pipe(fds) != 0) {
+    return false;
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  return true;
+#else
+  return pipe2(fds, O_CLOEXEC) == 0;
+#endif
+}
+
+/**
+ * popen() a command for reading, never while openPipe() is mid-way
+ *
+ * @param cmd The command to execute
+ * @return The stream, or nullptr if the command could not be started
+ */
+FILE *openCommand(const std::string &cmd) {
+  [[maybe_unused]] SpawnLock lock;
+  return popen(cmd.c_str(), "r");
+}
+
 /**
  * Execute a command and capture its output
  *
  * @param cmd The command to execute
+ * @param exitStatus Optional; receives the exit status (-1 if the command
+ * could not be run or was killed)
  * @return The command output as a string
  */
-std::string execCommand(const std::string &cmd) {
+std::string execCommand(const std::string &cmd, int *exitStatus = nullptr) {
   if (g_verbose) {
     logVerbose("  [CMD] " + cmd);
   }
-  std::array<char, 128> buffer;
+  std::array<char, 4096> buffer;
   std::string result;
-  FILE *pipe = popen(cmd.c_str(), "r");
+  if (exitStatus) {
+    *exitStatus = -1;
+  }
+  FILE *pipe = openCommand(cmd);
   if (!pipe) {
     if (g_verbose) {
       logVerbose("  [ERROR] Failed to execute command");
     }
     return "";
   }
-  while (fgets(buffer.data(), buffer.size(), pipe) != nullptr) {
-    result += buffer.data();
+  // fread rather than fgets, so output containing NUL bytes survives
+  size_t bytesRead;
+  while ((bytesRead = fread(buffer.data(), 1, buffer.size(), pipe)) > 0) {
+    result.append(buffer.data(), bytesRead);
+  }
+  int waitStatus = pclose(pipe);
+  if (exitStatus && waitStatus != -1 && WIFEXITED(waitStatus)) {
+    *exitStatus = WEXITSTATUS(waitStatus);
   }
-  pclose(pipe);
   if (g_verbose && !result.empty()) {
     if (result.back() != '\n') {
       result.push_back('\n');
@@ -121,545 +397,6868 @@ std::string execCommand(const std::string &cmd) {
 }
 
 /**
- * Check if a directory is a MediaWiki installation
+ * Execute a command and hand its output to a callback one line at a time,
+ * so callers never hold more than a single line of output in memory
  *
- * @param path The directory path to check
- * @return true if it is a MediaWiki installation, false otherwise
+ * @param cmd The command to execute
+ * @param onLine Callback invoked for each line (without the trailing newline)
+ * @return false if the command could not be started, true otherwise
  */
-bool isMediaWikiDirectory(const fs::path &path) {
-  // Check for key MediaWiki files and directories
-  bool hasIndexPhp = fs::exists(path / "index.php");
-  bool hasApiPhp = fs::exists(path / "api.php");
-  bool hasIncludesDir =
-      fs::exists(path / "includes") && fs::is_directory(path / "includes");
-  bool hasExtensionsDir =
-      fs::exists(path / "extensions") && fs::is_directory(path / "extensions");
-  bool hasSkinsDir =
-      fs::exists(path / "skins") && fs::is_directory(path / "skins");
+bool streamCommandLines(
+    const std::string &cmd,
+    const std::function<void(const std::string &)> &onLine) {
+  if (g_verbose) {
+    logVerbose("  [CMD] " + cmd);
+  }
+  std::array<char, 128> buffer;
+  std::string line;
+  FILE *pipe = openCommand(cmd);
+  if (!pipe) {
+    if (g_verbose) {
+      logVerbose("  [ERROR] Failed to execute command");
+    }
+    return false;
+  }
+  while (fgets(buffer.data(), buffer.size(), pipe) != nullptr) {
+    line += buffer.data();
+    if (!line.empty() && line.back() == '\n') {
+      line.pop_back();
+      onLine(line);
+      line.clear();
+    }
+  }
+  if (!line.empty()) {
+    onLine(line);
+  }
+  pclose(pipe);
+  return true;
+}
 
-  // A valid MediaWiki installation should have at least these core components
-  return hasIndexPhp && hasApiPhp && hasIncludesDir && hasExtensionsDir &&
-         hasSkinsDir;
+/**
+ * Check whether the installed git is at least the given version
+ *
+ * @param major The required major version
+ * @param minor The required minor version
+ * @return true if `git --version` reports at least major.minor
+ */
+bool gitVersionAtLeast(int major, int minor) {
+  static const std::pair<int, int> installed = []() {
+    std::string output = execCommand("git --version 2>/dev/null");
+    int gitMajor = 0, gitMinor = 0;
+    std::sscanf(output.c_str(), "git version %d.%d", &gitMajor, &gitMinor);
+    return std::make_pair(gitMajor, gitMinor);
+  }();
+  return installed >= std::make_pair(major, minor);
 }
 
+// Per-repository rules read from a file with one "<repo> <values...>" line
+// per repository. <repo> is "core", "<type>:<name>", "<name>" or "*".
+using RepoRules = std::map<std::string, std::vector<std::string>>;
+
+RepoRules g_strategyRules;
+
 /**
- * Check if a directory is a git repository
+ * Load a per-repository rules file; blank lines and # comments are ignored
  *
- * @param path The directory path to check
- * @return true if it is a git repository, false otherwise
+ * @param path The rules file
+ * @param rules Receives the rules
+ * @return false if the file could not be read
  */
-bool isGitRepo(const fs::path &path) { return fs::exists(path / ".git"); }
+bool loadRepoRules(const std::string &path, RepoRules &rules) {
+  std::ifstream file(path);
+  if (!file) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream words(line);
+    std::string key, value;
+    if (!(words >> key)) {
+      continue;
+    }
+    std::vector<std::string> &values = rules[key];
+    while (words >> value) {
+      values.push_back(value);
+    }
+  }
+  return true;
+}
 
 /**
- * Get the current branch name
+ * Find the rule for a repository, most specific first
  *
- * @param repoPath The repository path
- * @return The current branch name, or empty string on error
+ * @param rules The rules
+ * @param type The repository type
+ * @param name The repository name
+ * @return The matching rule's values, or nullptr if no rule applies
  */
-std::string getCurrentBranch(const fs::path &repoPath) {
-  std::string cmd = "cd \"" + repoPath.string() +
-                    "\" && git rev-parse --abbrev-ref HEAD 2>/dev/null";
-  std::string branch = execCommand(cmd);
-  // Remove trailing newline
-  if (!branch.empty() && branch.back() == '\n') {
-    branch.pop_back();
+const std::vector<std::string> *findRepoRule(const RepoRules &rules,
+                                             const std::string &type,
+                                             const std::string &name) {
+  for (const std::string &key :
+       {type == "core" ? std::string("core") : type + ":" + name, name,
+        std::string("*")}) {
+    auto it = rules.find(key);
+    if (it != rules.end()) {
+      return &it->second;
+    }
   }
-  return branch;
+  return nullptr;
 }
 
+// A state table maps a key (usually a canonical repository path) to a row of
+// tab-separated fields, persisted as <state dir>/<name>.tsv
+using StateTable = std::map<std::string, std::vector<std::string>>;
+
+// State tables loaded so far in this run, by name (guarded by g_stateMutex),
+// and each table as it was last read from disk, so saving can tell which
+// rows this process changed
+std::mutex g_stateMutex;
+std::map<std::string, StateTable> g_stateTables;
+std::map<std::string, StateTable> g_stateBaselines;
+
 /**
- * Fetch updates from remote
+ * Get the default directory for persistent state
  *
- * @param repoPath The repository path
- * @return true if fetch succeeded, false if error or fatal messages were
- * detected
+ * @return $XDG_STATE_HOME/local_mw, or ~/.local/state/local_mw
  */
-bool fetchUpdates(const fs::path &repoPath) {
-  std::string cmd = "cd \"" + repoPath.string() + "\" && git fetch 2>&1";
-  std::string output = execCommand(cmd);
-  return output.find("error") == std::string::npos &&
-         output.find("fatal") == std::string::npos;
+std::string defaultStateDir() {
+  const char *xdgState = std::getenv("XDG_STATE_HOME");
+  if (xdgState && *xdgState) {
+    return (fs::path(xdgState) / "local_mw").string();
+  }
+  const char *home = std::getenv("HOME");
+  return (fs::path(home ? home : ".") / ".local" / "state" / "local_mw")
+      .string();
 }
 
 /**
- * Check if local branch is behind remote
+ * Get the key identifying a repository in state tables
  *
  * @param repoPath The repository path
- * @param branch The branch name to check
- * @return Number of commits behind, or -1 on error
+ * @return The canonical repository path
  */
-int checkBehindCommits(const fs::path &repoPath, const std::string &branch) {
-  std::string cmd = "cd \"" + repoPath.string() +
-                    "\" && git rev-list --count HEAD..origin/" + branch +
-                    " 2>/dev/null";
-  std::string result = execCommand(cmd);
+std::string stateKey(const fs::path &repoPath) {
+  std::error_code ec;
+  fs::path canonical = fs::weakly_canonical(repoPath, ec);
+  return ec ? repoPath.string() : canonical.string();
+}
 
-  if (result.empty()) {
-    return -1; // Error or no tracking branch
+/**
+ * Load a state table from the state directory
+ *
+ * @param name The table name
+ * @return The table, empty if it does not exist yet
+ */
+StateTable loadStateTable(const std::string &name) {
+  StateTable table;
+  std::ifstream file(fs::path(g_stateDir) / (name + ".tsv"));
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string key, field;
+    if (!std::getline(fields, key, '\t') || key.empty()) {
+      continue;
+    }
+    std::vector<std::string> row;
+    while (std::getline(fields, field, '\t')) {
+      row.push_back(field);
+    }
+    table[key] = row;
   }
+  return table;
+}
 
-  try {
-    return std::stoi(result);
-  } catch (...) {
-    return -1;
+/**
+ * Save a state table to the state directory, replacing it atomically
+ *
+ * @param name The table name
+ * @param table The table to save
+ * @return true on success
+ */
+bool saveStateTable(const std::string &name, const StateTable &table) {
+  std::error_code ec;
+  fs::create_directories(g_stateDir, ec);
+  fs::path target = fs::path(g_stateDir) / (name + ".tsv");
+  fs::path temp = target;
+  temp += "." + std::to_string(getpid()) + ".tmp";
+  {
+    std::ofstream file(temp);
+    if (!file) {
+      logVerbose("  [WARNING] Could not write state file " + temp.string());
+      return false;
+    }
+    for (const auto &[key, row] : table) {
+      file << key;
+      for (const auto &field : row) {
+        file << '\t' << field;
+      }
+      file << '\n';
+    }
   }
+  fs::rename(temp, target, ec);
+  return !ec;
 }
 
 /**
- * Check if repository has uncommitted changes
+ * Get a state table, loading it on first use. The caller must hold
+ * g_stateMutex.
  *
- * @param repoPath The repository path
- * @return true if there are uncommitted changes, false otherwise
+ * @param name The table name
+ * @return The table, which saveStateTables() will persist
  */
-bool hasUncommittedChanges(const fs::path &repoPath) {
-  std::string cmd =
-      "cd \"" + repoPath.string() + "\" && git status --porcelain 2>/dev/null";
-  std::string result = execCommand(cmd);
-  return !result.empty();
+StateTable &stateTable(const std::string &name) {
+  auto it = g_stateTables.find(name);
+  if (it == g_stateTables.end()) {
+    it = g_stateTables.emplace(name, loadStateTable(name)).first;
+    g_stateBaselines[name] = it->second;
+  }
+  return it->second;
 }
 
 /**
- * Performs a git pull operation on the specified repository.
+ * Save every state table used in this run
  *
- * @param repoPath The filesystem path to the git repository.
- * @param errorMsg Reference to a string that will contain error output if the
- * operation fails.
- * @return true if git pull succeeded, false if error or fatal messages were
- * detected.
+ * Other processes (shard workers, a daemon next to a cron run) may have
+ * saved the same tables meanwhile, so only the rows this process changed
+ * are applied on top of what is on disk, under a lock on the state
+ * directory.
  */
-bool performGitPull(const fs::path &repoPath, std::string &errorMsg) {
-  std::string cmd = "cd \"" + repoPath.string() + "\" && git pull 2>&1";
-  std::string output = execCommand(cmd);
-
-  if (output.find("error") != std::string::npos ||
-      output.find("fatal") != std::string::npos) {
-    errorMsg = output;
-    return false;
+void saveStateTables() {
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  std::error_code ec;
+  fs::create_directories(g_stateDir, ec);
+  int lockFd = open((fs::path(g_stateDir) / ".lock").c_str(),
+                    O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lockFd >= 0) {
+    flock(lockFd, LOCK_EX);
+  }
+  for (auto &[name, table] : g_stateTables) {
+    StateTable &baseline = g_stateBaselines[name];
+    StateTable merged = loadStateTable(name);
+    for (const auto &[key, row] : table) {
+      auto it = baseline.find(key);
+      if (it == baseline.end() || it->second != row) {
+        merged[key] = row;
+      }
+    }
+    for (const auto &entry : baseline) {
+      if (table.find(entry.first) == table.end()) {
+        merged.erase(entry.first);
+      }
+    }
+    saveStateTable(name, merged);
+    table = merged;
+    baseline = merged;
+  }
+  if (lockFd >= 0) {
+    close(lockFd);
   }
-
-  return true;
 }
 
 /**
- * Check a repository for updates and optionally pull
+ * Format a duration in seconds compactly ("45s", "12m", "3h", "2d")
  *
- * @param repoPath The repository path
- * @param type The type of repository (core, extension, skin)
- * @return The repository status
+ * @param seconds The duration
+ * @return The formatted duration
  */
-RepoStatus checkRepository(const fs::path &repoPath, const std::string &type) {
-  if (g_verbose) {
-    std::ostringstream oss;
-    oss << "\n[CHECKING] " << repoPath.filename().string() << " (" << type
-        << ")\n";
-    oss << "  Path: " << repoPath.string() << "\n";
-    logVerbose(oss.str());
+std::string formatDuration(long long seconds) {
+  if (seconds < 60) {
+    return std::to_string(seconds) + "s";
+  }
+  if (seconds < 60 * 60) {
+    return std::to_string(seconds / 60) + "m";
   }
+  if (seconds < 24 * 60 * 60) {
+    return std::to_string(seconds / (60 * 60)) + "h";
+  }
+  return std::to_string(seconds / (24 * 60 * 60)) + "d";
+}
 
-  RepoStatus status;
-  status.name = repoPath.filename().string();
-  status.type = type;
-  status.isRepo = isGitRepo(repoPath);
-  status.hasUpdates = false;
-  status.behindBy = 0;
-  status.pulled = false;
-  status.hadUncommittedChanges = false;
+// A cursor over JSON text. The scanner functions below walk it once, without
+// building a document, and only materialise the values a caller asks for.
+struct JsonCursor {
+  const std::string &text;
+  size_t pos = 0;
+};
 
-  if (!status.isRepo) {
-    status.error = "Not a git repository";
-    if (g_verbose) {
-      logVerbose("  [SKIP] Not a git repository");
-    }
-    return status;
+/**
+ * Skip whitespace and return the next character without consuming it
+ *
+ * @param cursor The JSON cursor
+ * @return The next character, or '\0' at the end of the text
+ */
+char jsonPeek(JsonCursor &cursor) {
+  while (cursor.pos < cursor.text.size() &&
+         std::isspace(static_cast<unsigned char>(cursor.text[cursor.pos]))) {
+    cursor.pos++;
   }
+  return cursor.pos < cursor.text.size() ? cursor.text[cursor.pos] : '\0';
+}
 
-  // Get current branch
-  if (g_verbose) {
-    logVerbose("  [STEP] Getting current branch...");
+/**
+ * Read a JSON string, unescaping simple escapes (\uXXXX is kept as is)
+ *
+ * @param cursor The JSON cursor, positioned at the opening quote
+ * @param out Receives the string
+ * @return false on malformed input
+ */
+bool jsonReadString(JsonCursor &cursor, std::string &out) {
+  if (jsonPeek(cursor) != '"') {
+    return false;
   }
-  status.currentBranch = getCurrentBranch(repoPath);
-  if (status.currentBranch.empty()) {
-    status.error = "Could not determine branch";
-    if (g_verbose) {
-      logVerbose("  [ERROR] Could not determine branch");
+  out.clear();
+  for (cursor.pos++; cursor.pos < cursor.text.size(); cursor.pos++) {
+    char c = cursor.text[cursor.pos];
+    if (c == '"') {
+      cursor.pos++;
+      return true;
     }
-    return status;
-  }
-  if (g_verbose) {
-    logVerbose("  [INFO] Current branch: " + status.currentBranch);
+    if (c == '\\' && cursor.pos + 1 < cursor.text.size()) {
+      char escaped = cursor.text[++cursor.pos];
+      switch (escaped) {
+      case 'n':
+        out += '\n';
+        break;
+      case 't':
+        out += '\t';
+        break;
+      case 'u':
+        out += "\\u";
+        break;
+      default:
+        out += escaped;
+      }
+      continue;
+    }
+    out += c;
   }
+  return false;
+}
 
-  // Fetch updates
-  if (g_verbose) {
-    logVerbose("  [STEP] Fetching updates from remote...");
+/**
+ * Skip over one JSON value of any type
+ *
+ * @param cursor The JSON cursor, positioned at the value
+ * @return false on malformed input
+ */
+bool jsonSkipValue(JsonCursor &cursor) {
+  char c = jsonPeek(cursor);
+  if (c == '"') {
+    std::string ignored;
+    return jsonReadString(cursor, ignored);
   }
-  if (!fetchUpdates(repoPath)) {
-    status.error = "Failed to fetch updates";
-    if (g_verbose) {
-      logVerbose("  [ERROR] Failed to fetch updates");
+  if (c == '{' || c == '[') {
+    // Track nesting depth only; strings are skipped so brackets inside them
+    // are not counted
+    int depth = 0;
+    while (cursor.pos < cursor.text.size()) {
+      c = jsonPeek(cursor);
+      if (c == '"') {
+        std::string ignored;
+        if (!jsonReadString(cursor, ignored)) {
+          return false;
+        }
+        continue;
+      }
+      cursor.pos++;
+      if (c == '{' || c == '[') {
+        depth++;
+      } else if ((c == '}' || c == ']') && --depth == 0) {
+        return true;
+      }
     }
-    return status;
+    return false;
   }
-
-  // Check if behind
-  if (g_verbose) {
-    logVerbose("  [STEP] Checking commits behind remote...");
+  // Number, true, false or null
+  while (cursor.pos < cursor.text.size() &&
+         std::string(",}] \t\r\n").find(cursor.text[cursor.pos]) ==
+             std::string::npos) {
+    cursor.pos++;
   }
-  status.behindBy = checkBehindCommits(repoPath, status.currentBranch);
+  return true;
+}
 
-  // Check for uncommitted changes on all repos
-  if (g_verbose) {
-    logVerbose("  [STEP] Checking for uncommitted changes...");
+/**
+ * Walk the members of a JSON object, calling back for each key; the
+ * callback must consume the member's value
+ *
+ * @param cursor The JSON cursor, positioned at the opening brace
+ * @param onMember Called with each key; returns false to abort
+ * @return false on malformed input
+ */
+bool jsonScanObject(JsonCursor &cursor,
+                    const std::function<bool(const std::string &)> &onMember) {
+  if (jsonPeek(cursor) != '{') {
+    return false;
   }
-  status.hadUncommittedChanges = hasUncommittedChanges(repoPath);
-  if (status.hadUncommittedChanges && g_verbose) {
-    logVerbose("  [WARNING] Repository has uncommitted changes!");
+  cursor.pos++;
+  if (jsonPeek(cursor) == '}') {
+    cursor.pos++;
+    return true;
   }
-
-  if (status.behindBy > 0) {
-    status.hasUpdates = true;
-    if (g_verbose) {
-      logVerbose("  [RESULT] Behind by " + std::to_string(status.behindBy) +
-                 " commit(s)");
+  std::string key;
+  while (jsonReadString(cursor, key)) {
+    if (jsonPeek(cursor) != ':') {
+      return false;
     }
-
-    // Perform git pull if conditions are met
+    cursor.pos++;
+    if (!onMember(key)) {
+      return false;
+    }
+    char next = jsonPeek(cursor);
+    cursor.pos++;
+    if (next == '}') {
+      return true;
+    }
+    if (next != ',') {
+      return false;
+    }
+  }
+  return false;
+}
+
+/**
+ * Pull the version and MediaWiki requirement out of an extension.json or
+ * skin.json; everything else is skipped without being copied
+ *
+ * @param manifest The manifest text
+ * @param version Receives the top-level version (empty if absent)
+ * @param requiresMediaWiki Receives requires.MediaWiki (empty if absent)
+ * @return false if the manifest is not valid JSON as far as it was read
+ */
+bool scanManifest(const std::string &manifest, std::string &version,
+                  std::string &requiresMediaWiki) {
+  JsonCursor cursor{manifest};
+  version.clear();
+  requiresMediaWiki.clear();
+  return jsonScanObject(cursor, [&](const std::string &key) {
+    if (key == "version" && jsonPeek(cursor) == '"') {
+      return jsonReadString(cursor, version);
+    }
+    if (key != "requires" || jsonPeek(cursor) != '{') {
+      return jsonSkipValue(cursor);
+    }
+    return jsonScanObject(cursor, [&](const std::string &requirement) {
+      if (requirement == "MediaWiki" && jsonPeek(cursor) == '"') {
+        return jsonReadString(cursor, requiresMediaWiki);
+      }
+      return jsonSkipValue(cursor);
+    });
+  });
+}
+
+/**
+ * Split a version string into its numeric components ("1.43.0-alpha" gives
+ * 1, 43, 0); pre-release suffixes are ignored, as MediaWiki does
+ *
+ * @param version The version string
+ * @return The numeric components, or none if the version is unknown or a
+ * component does not fit in an int
+ */
+std::vector<int> parseVersion(const std::string &version) {
+  std::vector<int> parts;
+  size_t pos = version.find_first_of("0123456789");
+  while (pos < version.size() &&
+         std::isdigit(static_cast<unsigned char>(version[pos]))) {
+    // Manifests come from upstream, so a component may be any length
+    errno = 0;
+    char *end = nullptr;
+    long component = std::strtol(version.c_str() + pos, &end, 10);
+    if (errno == ERANGE || component > INT_MAX) {
+      return {};
+    }
+    parts.push_back(static_cast<int>(component));
+    pos = static_cast<size_t>(end - version.c_str());
+    if (pos >= version.size() || version[pos] != '.') {
+      break;
+    }
+    pos++;
+  }
+  return parts;
+}
+
+/**
+ * Compare two versions component by component (missing components are 0)
+ *
+ * @return Negative, zero or positive like strcmp
+ */
+int compareVersions(const std::vector<int> &a, const std::vector<int> &b) {
+  for (size_t i = 0; i < std::max(a.size(), b.size()); i++) {
+    int left = i < a.size() ? a[i] : 0;
+    int right = i < b.size() ? b[i] : 0;
+    if (left != right) {
+      return left < right ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Check a version against a Composer-style constraint as used in
+ * extension.json: ">= 1.42", "^1.41", "1.43.*", hyphen ranges like
+ * "1.39 - 1.42", ranges separated by spaces or commas, and alternatives
+ * separated by "||"
+ *
+ * @param version The version to check
+ * @param constraint The constraint
+ * @return true if the version satisfies the constraint, or if either of
+ * them cannot be parsed (nothing is held back on a guess)
+ */
+bool versionSatisfies(const std::string &version,
+                      const std::string &constraint) {
+  std::vector<int> have = parseVersion(version);
+  if (have.empty()) {
+    return true;
+  }
+  size_t start = 0;
+  while (start <= constraint.size()) {
+    size_t end = constraint.find("||", start);
+    std::string alternative = constraint.substr(
+        start, end == std::string::npos ? std::string::npos : end - start);
+    start = end == std::string::npos ? constraint.size() + 1 : end + 2;
+
+    // Glue operators to their versions (">= 1.42" becomes ">=1.42")
+    std::string compact;
+    for (size_t i = 0; i < alternative.size(); i++) {
+      char c = alternative[i];
+      if (c == ',') {
+        c = ' ';
+      }
+      if (c == ' ' && !compact.empty() &&
+          std::string("<>=!^~").find(compact.back()) != std::string::npos) {
+        continue;
+      }
+      compact += c;
+    }
+
+    bool satisfied = true;
+    std::vector<std::string> terms;
+    std::istringstream words(compact);
+    for (std::string word; words >> word;) {
+      terms.push_back(word);
+    }
+    for (size_t i = 0; i < terms.size(); i++) {
+      const std::string &term = terms[i];
+      if (i + 2 < terms.size() && terms[i + 1] == "-") {
+        // "A - B" is ">=A <=B", except that a partial B allows every
+        // version it prefixes: "1.39 - 1.42" allows 1.42.5
+        std::vector<int> low = parseVersion(term);
+        std::vector<int> high = parseVersion(terms[i + 2]);
+        if (low.empty() || high.empty()) {
+          return true;
+        }
+        bool belowHigh;
+        if (high.size() < 3 && high.back() < INT_MAX) {
+          high.back()++;
+          belowHigh = compareVersions(have, high) < 0;
+        } else {
+          belowHigh = compareVersions(have, high) <= 0;
+        }
+        satisfied =
+            satisfied && compareVersions(have, low) >= 0 && belowHigh;
+        i += 2;
+        continue;
+      }
+      size_t opEnd = term.find_first_not_of("<>=!^~");
+      std::string op = term.substr(0, opEnd);
+      std::string operand =
+          opEnd == std::string::npos ? "" : term.substr(opEnd);
+      if (operand == "*") {
+        continue;
+      }
+      std::vector<int> want = parseVersion(operand);
+      if (want.empty()) {
+        return true;
+      }
+      int cmp = compareVersions(have, want);
+      if (operand.find('*') != std::string::npos || op == "~" || op == "^") {
+        // Wildcards and ^/~ pin the leading components
+        size_t pinned = want.size();
+        if (op == "^") {
+          pinned = 1;
+        } else if (op == "~") {
+          pinned = std::max<size_t>(1, want.size() - 1);
+        }
+        bool prefixMatches = true;
+        for (size_t i = 0; i < pinned && i < want.size(); i++) {
+          prefixMatches =
+              prefixMatches && i < have.size() && have[i] == want[i];
+        }
+        satisfied = satisfied && prefixMatches && (op.empty() || cmp >= 0);
+      } else if (op == ">=") {
+        satisfied = satisfied && cmp >= 0;
+      } else if (op == ">") {
+        satisfied = satisfied && cmp > 0;
+      } else if (op == "<=") {
+        satisfied = satisfied && cmp <= 0;
+      } else if (op == "<") {
+        satisfied = satisfied && cmp < 0;
+      } else if (op == "!=") {
+        satisfied = satisfied && cmp != 0;
+      } else {
+        satisfied = satisfied && cmp == 0;
+      }
+    }
+    if (!terms.empty() && satisfied) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Read the installed MediaWiki version from core's working tree
+ *
+ * @param basePath The MediaWiki installation path
+ * @return The version (e.g. "1.43.0-alpha"), or empty string if not found
+ */
+std::string readCoreVersion(const fs::path &basePath) {
+  // MW_VERSION in includes/Defines.php since 1.35, $wgVersion before that
+  for (const auto &[file, marker] :
+       {std::make_pair("includes/Defines.php", "'MW_VERSION'"),
+        std::make_pair("includes/DefaultSettings.php", "$wgVersion")}) {
+    std::ifstream source(basePath / file);
+    std::string line;
+    while (std::getline(source, line)) {
+      size_t pos = line.find(marker);
+      if (pos == std::string::npos) {
+        continue;
+      }
+      size_t open = line.find('\'', pos + std::strlen(marker));
+      size_t close = line.find('\'', open + 1);
+      if (open != std::string::npos && close != std::string::npos) {
+        return line.substr(open + 1, close - open - 1);
+      }
+    }
+  }
+  return "";
+}
+
+/**
+ * Check if a directory is a MediaWiki installation
+ *
+ * @param path The directory path to check
+ * @return true if it is a MediaWiki installation, false otherwise
+ */
+bool isMediaWikiDirectory(const fs::path &path) {
+  // Check for key MediaWiki files and directories
+  bool hasIndexPhp = fs::exists(path / "index.php");
+  bool hasApiPhp = fs::exists(path / "api.php");
+  bool hasIncludesDir =
+      fs::exists(path / "includes") && fs::is_directory(path / "includes");
+  bool hasExtensionsDir =
+      fs::exists(path / "extensions") && fs::is_directory(path / "extensions");
+  bool hasSkinsDir =
+      fs::exists(path / "skins") && fs::is_directory(path / "skins");
+
+  // A valid MediaWiki installation should have at least these core components
+  return hasIndexPhp && hasApiPhp && hasIncludesDir && hasExtensionsDir &&
+         hasSkinsDir;
+}
+
+/**
+ * Check if a directory is a git repository
+ *
+ * @param path The directory path to check
+ * @return true if it is a git repository, false otherwise
+ */
+bool isGitRepo(const fs::path &path) { return fs::exists(path / ".git"); }
+
+/**
+ * Read the first line of a small file, without its line ending
+ *
+ * @param path The file to read
+ * @return The first line, or empty string if the file could not be read
+ */
+std::string readFirstLine(const fs::path &path) {
+  std::ifstream file(path);
+  std::string line;
+  if (file && std::getline(file, line) && !line.empty() &&
+      line.back() == '\r') {
+    line.pop_back();
+  }
+  return line;
+}
+
+/**
+ * Locate the git directory of a working tree, following "gitdir:" files
+ * used by submodules and linked worktrees
+ *
+ * @param repoPath The repository path
+ * @return The git directory, or empty path if there is none
+ */
+fs::path resolveGitDir(const fs::path &repoPath) {
+  std::error_code ec;
+  fs::path dotGit = repoPath / ".git";
+  if (fs::is_directory(dotGit, ec)) {
+    return dotGit;
+  }
+  std::string line = readFirstLine(dotGit);
+  const std::string prefix = "gitdir: ";
+  if (line.compare(0, prefix.size(), prefix) != 0) {
+    return fs::path();
+  }
+  fs::path gitDir(line.substr(prefix.size()));
+  return gitDir.is_absolute() ? gitDir : repoPath / gitDir;
+}
+
+/**
+ * Locate the directory holding shared repository data (config, refs,
+ * objects), which differs from the git directory in linked worktrees
+ *
+ * @param gitDir The git directory
+ * @return The common directory
+ */
+fs::path resolveCommonDir(const fs::path &gitDir) {
+  std::string line = readFirstLine(gitDir / "commondir");
+  if (line.empty()) {
+    return gitDir;
+  }
+  fs::path commonDir(line);
+  return commonDir.is_absolute() ? commonDir : gitDir / commonDir;
+}
+
+/**
+ * Get the branch HEAD points at by reading it directly from the git
+ * directory, without starting a git process
+ *
+ * @param repoPath The repository path
+ * @return The branch name, "HEAD" when detached, or empty string on error
+ */
+std::string readHeadBranch(const fs::path &repoPath) {
+  fs::path gitDir = resolveGitDir(repoPath);
+  if (gitDir.empty()) {
+    return "";
+  }
+  std::string head = readFirstLine(gitDir / "HEAD");
+  const std::string prefix = "ref: refs/heads/";
+  if (head.compare(0, prefix.size(), prefix) == 0) {
+    return head.substr(prefix.size());
+  }
+  return head.empty() ? "" : "HEAD";
+}
+
+/**
+ * Resolve a ref to an object id by reading loose refs and packed-refs
+ * directly, following symbolic refs
+ *
+ * @param repoPath The repository path
+ * @param refName The full ref name ("HEAD", "refs/remotes/origin/master")
+ * @return The object id, or empty string if the ref could not be resolved
+ */
+std::string readRefOid(const fs::path &repoPath, const std::string &refName) {
+  fs::path gitDir = resolveGitDir(repoPath);
+  if (gitDir.empty()) {
+    return "";
+  }
+  fs::path commonDir = resolveCommonDir(gitDir);
+
+  std::string name = refName;
+  for (int depth = 0; depth < 5; depth++) {
+    // HEAD and other pseudo-refs are per worktree, everything else is shared
+    bool perWorktree = name.compare(0, 5, "refs/") != 0;
+    fs::path refDir = perWorktree ? gitDir : commonDir;
+    std::string value = readFirstLine(refDir / name);
+    if (value.compare(0, 5, "ref: ") == 0) {
+      name = value.substr(5);
+      continue;
+    }
+    if (!value.empty()) {
+      return value;
+    }
+
+    std::ifstream packed(commonDir / "packed-refs");
+    std::string line;
+    while (std::getline(packed, line)) {
+      size_t space = line.find(' ');
+      if (line.empty() || line[0] == '#' || line[0] == '^' ||
+          space == std::string::npos) {
+        continue;
+      }
+      if (line.compare(space + 1, std::string::npos, name) == 0) {
+        return line.substr(0, space);
+      }
+    }
+    return "";
+  }
+  return "";
+}
+
+/**
+ * Get the URL of a remote by reading the repository config file directly
+ *
+ * @param repoPath The repository path
+ * @param remote The remote name
+ * @return The remote URL, or empty string if it is not configured
+ */
+std::string readRemoteUrl(const fs::path &repoPath,
+                          const std::string &remote = "origin") {
+  fs::path gitDir = resolveGitDir(repoPath);
+  if (gitDir.empty()) {
+    return "";
+  }
+  std::ifstream config(resolveCommonDir(gitDir) / "config");
+  const std::string section = "[remote \"" + remote + "\"]";
+  bool inSection = false;
+  std::string line;
+  while (std::getline(config, line)) {
+    size_t start = line.find_first_not_of(" \t");
+    if (start == std::string::npos) {
+      continue;
+    }
+    line = line.substr(start);
+    if (line[0] == '[') {
+      inSection = line.compare(0, section.size(), section) == 0;
+      continue;
+    }
+    size_t equals = line.find('=');
+    if (!inSection || equals == std::string::npos) {
+      continue;
+    }
+    std::string key = line.substr(0, equals);
+    key.erase(key.find_last_not_of(" \t") + 1);
+    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+    if (key == "url") {
+      std::string value = line.substr(equals + 1);
+      value.erase(0, value.find_first_not_of(" \t"));
+      value.erase(value.find_last_not_of(" \t\r") + 1);
+      return value;
+    }
+  }
+  return "";
+}
+
+/**
+ * Normalise a remote URL for comparison: trailing slashes and a ".git"
+ * suffix are ignored
+ *
+ * @param url The remote URL
+ * @return The normalised URL
+ */
+std::string normalizeRemoteUrl(std::string url) {
+  while (!url.empty() && url.back() == '/') {
+    url.pop_back();
+  }
+  if (url.size() > 4 && url.compare(url.size() - 4, 4, ".git") == 0) {
+    url.erase(url.size() - 4);
+  }
+  return url;
+}
+
+/**
+ * Get the current branch name
+ *
+ * @param repoPath The repository path
+ * @return The current branch name, or empty string on error
+ */
+std::string getCurrentBranch(const fs::path &repoPath) {
+  std::string nativeBranch = g_native ? readHeadBranch(repoPath) : "";
+  if (!nativeBranch.empty()) {
+    return nativeBranch;
+  }
+
+  std::string cmd = "cd \"" + repoPath.string() +
+                    "\" && git rev-parse --abbrev-ref HEAD 2>/dev/null";
+  std::string branch = execCommand(cmd);
+  // Remove trailing newline
+  if (!branch.empty() && branch.back() == '\n') {
+    branch.pop_back();
+  }
+  return branch;
+}
+
+/**
+ * Check whether git output shows that another git process holds a lock
+ *
+ * @param output The combined stdout/stderr of a git command
+ * @return true if the command failed on an existing lock file
+ */
+bool isLockContention(const std::string &output) {
+  return output.find(".lock': File exists") != std::string::npos ||
+         output.find("cannot lock ref") != std::string::npos ||
+         output.find("Another git process seems to be running") !=
+             std::string::npos;
+}
+
+
+/**
+ * Classify the outcome of a git command
+ *
+ * Success is decided by the exit status alone, so output that merely
+ * mentions a file like ErrorPage.php is not mistaken for a failure.
+ *
+ * @param exitStatus The exit status (-1 if unknown or killed)
+ * @param output The combined stdout/stderr of the command
+ * @return The failure class, or GitFailure::None on success
+ */
+GitFailure classifyGitFailure(int exitStatus, const std::string &output) {
+  if (exitStatus == 0) {
+    return GitFailure::None;
+  }
+  auto mentions = [&output](std::initializer_list<const char *> patterns) {
+    for (const char *pattern : patterns) {
+      if (output.find(pattern) != std::string::npos) {
+        return true;
+      }
+    }
+    return false;
+  };
+  if (isLockContention(output)) {
+    return GitFailure::LockContention;
+  }
+  if (mentions({"No space left on device", "Disk quota exceeded"})) {
+    return GitFailure::DiskFull;
+  }
+  if (mentions({"Authentication failed", "Permission denied (publickey",
+                "could not read Username", "could not read Password",
+                "HTTP Basic: Access denied", "The requested URL returned "
+                                             "error: 403",
+                "The requested URL returned error: 401"})) {
+    return GitFailure::Auth;
+  }
+  if (mentions({"Repository not found", "does not appear to be a git "
+                                        "repository",
+                "couldn't find remote ref", "The requested URL returned "
+                                            "error: 404"})) {
+    return GitFailure::NotFound;
+  }
+  if (mentions({"Could not resolve host", "Connection timed out",
+                "Connection refused", "Connection reset", "timed out",
+                "early EOF", "The remote end hung up unexpectedly",
+                "Network is unreachable", "RPC failed",
+                "unable to access", "The requested URL returned error: 5",
+                "Temporary failure in name resolution"})) {
+    return GitFailure::Network;
+  }
+  if (mentions({"Not possible to fast-forward", "non-fast-forward",
+                "divergent branches", "have diverged", "CONFLICT"})) {
+    return GitFailure::NonFastForward;
+  }
+  if (mentions({"would be overwritten by", "Please commit your changes or "
+                                           "stash them"})) {
+    return GitFailure::LocalChanges;
+  }
+  return GitFailure::Other;
+}
+
+/**
+ * Check whether a failure class is worth retrying straight away
+ *
+ * @param failure The failure class
+ * @return true for transient failures
+ */
+bool isTransientFailure(GitFailure failure) {
+  return failure == GitFailure::Network;
+}
+
+/**
+ * Describe a failure class in a few words
+ *
+ * @param failure The failure class
+ * @return The description
+ */
+std::string describeFailure(GitFailure failure) {
+  switch (failure) {
+  case GitFailure::None:
+    return "ok";
+  case GitFailure::LockContention:
+    return "locked by another git process";
+  case GitFailure::Network:
+    return "network error";
+  case GitFailure::Auth:
+    return "authentication failed";
+  case GitFailure::NotFound:
+    return "remote repository or branch not found";
+  case GitFailure::NonFastForward:
+    return "not a fast-forward";
+  case GitFailure::LocalChanges:
+    return "local changes would be overwritten";
+  case GitFailure::DiskFull:
+    return "disk full";
+  case GitFailure::Other:
+    break;
+  }
+  return "failed";
+}
+
+/**
+ * Run a git operation, retrying with exponential backoff while another git
+ * process holds a lock in the repository
+ *
+ * @param run Runs one attempt and returns its combined stdout/stderr
+ * @param lockContention Optional flag set when the lock was still held after
+ * the last attempt
+ * @return The output of the last attempt
+ */
+std::string retryWhileLocked(const std::function<std::string()> &run,
+                             bool *lockContention = nullptr) {
+  std::string output;
+  int delayMs = LOCK_RETRY_BASE_MS;
+  for (int attempt = 1; attempt <= LOCK_RETRY_ATTEMPTS; attempt++) {
+    output = run();
+    if (!isLockContention(output)) {
+      if (lockContention) {
+        *lockContention = false;
+      }
+      return output;
+    }
+    if (attempt < LOCK_RETRY_ATTEMPTS) {
+      if (g_verbose) {
+        logVerbose("  [RETRY] Repository is locked, retrying in " +
+                   std::to_string(delayMs) + "ms");
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+      delayMs *= 2;
+    }
+  }
+  if (lockContention) {
+    *lockContention = true;
+  }
+  return output;
+}
+
+/**
+ * Execute a git command, retrying with exponential backoff while another
+ * git process holds a lock in the repository
+ *
+ * @param cmd The command to execute (stderr should be redirected to stdout)
+ * @param lockContention Optional flag set when the lock was still held after
+ * the last attempt
+ * @return The output of the last attempt
+ */
+std::string execWithLockRetry(const std::string &cmd,
+                              bool *lockContention = nullptr) {
+  return retryWhileLocked([&cmd]() { return execCommand(cmd); },
+                          lockContention);
+}
+
+/**
+ * Run a git command, retrying transient failures with exponential backoff
+ * and lock contention with retryWhileLocked()
+ *
+ * @param run Runs the command once, returning its output and setting the
+ * exit status
+ * @param failure Receives the failure class of the last attempt
+ * @return The output of the last attempt
+ */
+std::string runClassified(const std::function<std::string(int &)> &run,
+                          GitFailure &failure) {
+  std::string output;
+  int delayMs = TRANSIENT_RETRY_BASE_MS;
+  for (int attempt = 1; attempt <= TRANSIENT_RETRY_ATTEMPTS; attempt++) {
+    int exitStatus = -1;
+    output = retryWhileLocked([&]() { return run(exitStatus); });
+    failure = classifyGitFailure(exitStatus, output);
+    if (!isTransientFailure(failure) || attempt == TRANSIENT_RETRY_ATTEMPTS) {
+      break;
+    }
+    if (g_verbose) {
+      logVerbose("  [RETRY] " + describeFailure(failure) + ", retrying in " +
+                 std::to_string(delayMs) + "ms");
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+    delayMs *= 2;
+  }
+  return output;
+}
+
+// A shell command started in its own process group so that it can be
+// cancelled together with every process it starts
+struct ChildProcess {
+  pid_t pid = -1;
+  int outputFd = -1;
+  std::string output;
+  bool finished = false;
+  bool succeeded = false;
+  int exitStatus = -1;
+};
+
+/**
+ * Start a shell command with stdout and stderr going to a pipe
+ *
+ * @param cmd The command to execute
+ * @param child Receives the process id and pipe
+ * @return true if the command was started
+ */
+bool startChildProcess(const std::string &cmd, ChildProcess &child) {
+  if (g_verbose) {
+    logVerbose("  [CMD] " + cmd);
+  }
+  int fds[2];
+  if (!openPipe(fds)) {
+    return false;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addclose(&actions, fds[0]);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+  posix_spawn_file_actions_addclose(&actions, fds[1]);
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&attributes, 0);
+
+  const char *argv[] = {"sh", "-c", cmd.c_str(), nullptr};
+  int result;
+  {
+    [[maybe_unused]] SpawnLock lock;
+    result = posix_spawn(&child.pid, "/bin/sh", &actions, &attributes,
+                         const_cast<char *const *>(argv), environ);
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attributes);
+  close(fds[1]);
+  if (result != 0) {
+    close(fds[0]);
+    child.pid = -1;
+    return false;
+  }
+  child.outputFd = fds[0];
+  return true;
+}
+
+/**
+ * Read whatever output a child has produced; once its output is closed,
+ * reap it and record whether it succeeded
+ *
+ * @param child The child process
+ */
+void drainChildProcess(ChildProcess &child) {
+  std::array<char, 4096> buffer;
+  ssize_t received = read(child.outputFd, buffer.data(), buffer.size());
+  if (received > 0) {
+    child.output.append(buffer.data(), static_cast<size_t>(received));
+    return;
+  }
+  if (received < 0 && errno == EINTR) {
+    return;
+  }
+  close(child.outputFd);
+  child.outputFd = -1;
+  int waitStatus = 0;
+  waitpid(child.pid, &waitStatus, 0);
+  child.finished = true;
+  child.exitStatus = WIFEXITED(waitStatus) ? WEXITSTATUS(waitStatus) : -1;
+  child.succeeded = child.exitStatus == 0;
+}
+
+/**
+ * Cancel a running child and every process it started
+ *
+ * SIGTERM lets git remove its lock and temporary pack files on the way out.
+ *
+ * @param child The child process
+ */
+void cancelChildProcess(ChildProcess &child) {
+  if (child.finished || child.pid < 0) {
+    return;
+  }
+  kill(-child.pid, SIGTERM);
+  if (child.outputFd >= 0) {
+    close(child.outputFd);
+    child.outputFd = -1;
+  }
+  int waitStatus = 0;
+  waitpid(child.pid, &waitStatus, 0);
+  child.finished = true;
+}
+
+// A long-lived `git cat-file --batch-command` process serving object and ref
+// questions for the repository a worker thread is currently checking
+struct CatFileSession {
+  fs::path repoPath;
+  pid_t pid = -1;
+  int toGit = -1;
+  int fromGit = -1;
+  std::string buffer;
+  bool failed = false;
+};
+
+struct CatFileReply {
+  bool found = false;
+  std::string oid;
+  std::string type;
+  std::string contents;
+};
+
+// The session of the repository this thread is checking, if any
+thread_local CatFileSession *t_catFile = nullptr;
+
+/**
+ * Start a cat-file co-process with pipes to both its stdin and stdout
+ *
+ * @param session The session, with repoPath set
+ * @return true if the process was started
+ */
+bool startCatFile(CatFileSession &session) {
+  if (g_verbose) {
+    logVerbose("  [CMD] git cat-file --batch-command (co-process)");
+  }
+  int input[2], output[2];
+  if (!openPipe(input)) {
+    return false;
+  }
+  if (!openPipe(output)) {
+    close(input[0]);
+    close(input[1]);
+    return false;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, input[0], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, output[1], STDOUT_FILENO);
+  // Its complaints about a bad repository would land in the middle of the
+  // report; a failed query falls back to a one-off git anyway
+  posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&attributes, 0);
+
+  std::string gitDirArg =
+      "--git-dir=" + resolveGitDir(session.repoPath).string();
+  const char *argv[] = {"git",           gitDirArg.c_str(), "cat-file",
+                        "--batch-command", nullptr};
+  int result;
+  {
+    [[maybe_unused]] SpawnLock lock;
+    result = posix_spawnp(&session.pid, "git", &actions, &attributes,
+                          const_cast<char *const *>(argv), environ);
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attributes);
+  close(input[0]);
+  close(output[1]);
+  if (result != 0) {
+    close(input[1]);
+    close(output[0]);
+    session.pid = -1;
+    return false;
+  }
+  session.toGit = input[1];
+  session.fromGit = output[0];
+  return true;
+}
+
+/**
+ * End a cat-file co-process: closing its input makes it exit
+ *
+ * @param session The session
+ */
+void stopCatFile(CatFileSession &session) {
+  if (session.pid < 0) {
+    return;
+  }
+  close(session.toGit);
+  close(session.fromGit);
+  int waitStatus = 0;
+  waitpid(session.pid, &waitStatus, 0);
+  session.pid = -1;
+}
+
+/**
+ * Try to take one complete reply off the front of the session buffer
+ *
+ * @param session The session
+ * @param withContents Whether the request was "contents" (else "info")
+ * @param reply Receives the reply
+ * @return false if the buffer does not hold a complete reply yet
+ */
+bool parseCatFileReply(CatFileSession &session, bool withContents,
+                       CatFileReply &reply) {
+  size_t headerEnd = session.buffer.find('\n');
+  if (headerEnd == std::string::npos) {
+    return false;
+  }
+  std::istringstream header(session.buffer.substr(0, headerEnd));
+  std::string oid, type;
+  size_t size = 0;
+  // "<rev> missing" and "<rev> ambiguous" have no size
+  if (!(header >> oid >> type >> size)) {
+    session.buffer.erase(0, headerEnd + 1);
+    reply = CatFileReply();
+    return true;
+  }
+  size_t end = headerEnd + 1;
+  if (withContents) {
+    if (session.buffer.size() < end + size + 1) {
+      return false;
+    }
+    reply.contents = session.buffer.substr(end, size);
+    end += size + 1;
+  }
+  reply.found = true;
+  reply.oid = oid;
+  reply.type = type;
+  session.buffer.erase(0, end);
+  return true;
+}
+
+/**
+ * Write to a pipe with SIGPIPE blocked for the calling thread, so a reader
+ * that has died shows up as EPIPE instead of killing the whole process
+ *
+ * @param fd The write end of the pipe
+ * @param data The bytes to write
+ * @param size How many bytes to write
+ * @return The result of write(), with errno preserved
+ */
+ssize_t writeWithoutSigpipe(int fd, const char *data, size_t size) {
+  sigset_t pipeSignal, previous;
+  sigemptyset(&pipeSignal);
+  sigaddset(&pipeSignal, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipeSignal, &previous);
+  ssize_t written = write(fd, data, size);
+  int savedErrno = errno;
+  if (written < 0 && savedErrno == EPIPE &&
+      !sigismember(&previous, SIGPIPE)) {
+    // Take the signal this write raised before unblocking it; nothing is
+    // pending when SIGPIPE is ignored, as in daemon mode
+    sigset_t pending;
+    sigpending(&pending);
+    if (sigismember(&pending, SIGPIPE)) {
+      int signal = 0;
+      sigwait(&pipeSignal, &signal);
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+  errno = savedErrno;
+  return written;
+}
+
+/**
+ * Send a batch of "info <rev>" or "contents <rev>" commands to the
+ * co-process of the repository this thread is checking, starting it on
+ * first use, and collect the replies
+ *
+ * Requests are pipelined: commands are written while replies are read, so
+ * a batch costs no process spawns and a single round of pipe traffic.
+ *
+ * @param repoPath The repository path
+ * @param commands The commands, without trailing newlines
+ * @param replies Receives one reply per command
+ * @return false if no co-process is available for this repository
+ */
+bool catFileQuery(const fs::path &repoPath,
+                  const std::vector<std::string> &commands,
+                  std::vector<CatFileReply> &replies) {
+  CatFileSession *session = t_catFile;
+  if (!session || session->failed || session->repoPath != repoPath ||
+      !gitVersionAtLeast(2, 36)) {
+    return false;
+  }
+  if (session->pid < 0 && !startCatFile(*session)) {
+    session->failed = true;
+    return false;
+  }
+
+  std::string pending;
+  for (const auto &command : commands) {
+    pending += command + "\n";
+  }
+  replies.assign(commands.size(), CatFileReply());
+  size_t replied = 0;
+  while (replied < commands.size()) {
+    pollfd fds[2] = {{session->fromGit, POLLIN, 0},
+                     {session->toGit, POLLOUT, 0}};
+    if (poll(fds, pending.empty() ? 1 : 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (!pending.empty() && (fds[1].revents & POLLOUT)) {
+      ssize_t written =
+          writeWithoutSigpipe(session->toGit, pending.data(), pending.size());
+      // EPIPE: the co-process exited, so it is unavailable from now on
+      if (written < 0 && errno != EINTR) {
+        break;
+      }
+      pending.erase(0, written > 0 ? static_cast<size_t>(written) : 0);
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP)) {
+      std::array<char, 65536> chunk;
+      ssize_t received = read(session->fromGit, chunk.data(), chunk.size());
+      if (received <= 0) {
+        if (received < 0 && errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      session->buffer.append(chunk.data(), static_cast<size_t>(received));
+      while (replied < commands.size() &&
+             parseCatFileReply(*session,
+                               commands[replied].compare(0, 9, "contents ") ==
+                                   0,
+                               replies[replied])) {
+        replied++;
+      }
+    }
+  }
+  if (replied < commands.size()) {
+    // The process died or the pipe broke: don't use it again
+    stopCatFile(*session);
+    session->failed = true;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Resolve a ref to an object id: natively when allowed, otherwise through
+ * the repository's cat-file co-process, otherwise with a one-off git
+ *
+ * @param repoPath The repository path
+ * @param refName The full ref name ("HEAD", "refs/remotes/origin/master")
+ * @return The object id, or empty string if the ref could not be resolved
+ */
+std::string resolveRefOid(const fs::path &repoPath,
+                          const std::string &refName) {
+  if (g_native) {
+    std::string oid = readRefOid(repoPath, refName);
+    if (!oid.empty()) {
+      return oid;
+    }
+  }
+  std::vector<CatFileReply> replies;
+  if (catFileQuery(repoPath, {"info " + refName}, replies)) {
+    return replies[0].found ? replies[0].oid : "";
+  }
+  std::string oid = execCommand("cd \"" + repoPath.string() +
+                                "\" && git rev-parse --verify -q \"" +
+                                refName + "^{}\" 2>/dev/null");
+  while (!oid.empty() && std::isspace(static_cast<unsigned char>(oid.back()))) {
+    oid.pop_back();
+  }
+  return oid;
+}
+
+// Gives the calling thread a cat-file session for one repository check; the
+// co-process is only started if something actually queries it
+struct CatFileScope {
+  CatFileSession session;
+  CatFileSession *previous;
+
+  explicit CatFileScope(const fs::path &repoPath) : previous(t_catFile) {
+    session.repoPath = repoPath;
+    t_catFile = &session;
+  }
+  ~CatFileScope() {
+    stopCatFile(session);
+    t_catFile = previous;
+  }
+  CatFileScope(const CatFileScope &) = delete;
+  CatFileScope &operator=(const CatFileScope &) = delete;
+};
+
+/**
+ * Read an extension's or skin's manifest at the upstream revision straight
+ * from the object store, without checking it out
+ *
+ * @param repoPath The repository path
+ * @param branch The branch whose upstream is read
+ * @param type The repository type (extension or skin)
+ * @return The manifest text, or empty string if there is none
+ */
+std::string readUpstreamManifest(const fs::path &repoPath,
+                                 const std::string &branch,
+                                 const std::string &type) {
+  const char *manifest = type == "skin" ? "skin.json" : "extension.json";
+  std::vector<CatFileReply> replies;
+  if (catFileQuery(repoPath,
+                   {"contents origin/" + branch + ":" + manifest}, replies)) {
+    return replies[0].found ? replies[0].contents : "";
+  }
+  return execCommand("cd \"" + repoPath.string() +
+                     "\" && git cat-file blob origin/" + branch + ":" +
+                     manifest + " 2>/dev/null");
+}
+
+/**
+ * Get the host part of a remote URL, used to group fetch latencies
+ *
+ * @param url The remote URL (scheme://host/path or user@host:path)
+ * @return The host name, or "local" for local paths
+ */
+std::string remoteHost(const std::string &url) {
+  std::string rest = url;
+  size_t scheme = url.find("://");
+  if (scheme != std::string::npos) {
+    rest = url.substr(scheme + 3);
+    if (url.compare(0, scheme, "file") == 0) {
+      return "local";
+    }
+  } else if (url.find(':') == std::string::npos ||
+             url.find('/') < url.find(':')) {
+    return "local";
+  }
+  rest = rest.substr(0, rest.find_first_of("/:"));
+  size_t at = rest.find('@');
+  return at == std::string::npos ? rest : rest.substr(at + 1);
+}
+
+// Per-fetch latencies of this run, for the FETCH LATENCY histogram
+struct FetchStats {
+  std::vector<long long> observedMs;
+  // What each fetch would have taken without hedging, estimated from the
+  // host's history for fetches won by the hedge
+  std::vector<long long> unhedgedMs;
+  int hedged = 0;
+  int hedgeWins = 0;
+};
+
+std::mutex g_fetchStatsMutex;
+FetchStats g_fetchStats;
+std::atomic<int> g_fetchesStarted{0};
+std::atomic<int> g_hedgesStarted{0};
+std::atomic<int> g_hedgesRunning{0};
+
+/**
+ * Get the saved fetch latency samples of a host, in milliseconds
+ *
+ * @param host The git host
+ * @return The samples, oldest first
+ */
+std::vector<long long> hostLatencySamples(const std::string &host) {
+  std::vector<long long> samples;
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  StateTable &latencies = stateTable("fetch-latency");
+  auto it = latencies.find(host);
+  if (it != latencies.end()) {
+    for (const auto &field : it->second) {
+      try {
+        samples.push_back(std::stoll(field));
+      } catch (...) {
+        // Skip unreadable samples
+      }
+    }
+  }
+  return samples;
+}
+
+/**
+ * Save a fetch latency sample for a host, keeping the latest
+ * LATENCY_SAMPLES_KEPT
+ *
+ * @param host The git host
+ * @param elapsedMs The fetch latency in milliseconds
+ */
+void recordHostLatency(const std::string &host, long long elapsedMs) {
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  std::vector<std::string> &row = stateTable("fetch-latency")[host];
+  row.push_back(std::to_string(elapsedMs));
+  if (row.size() > LATENCY_SAMPLES_KEPT) {
+    row.erase(row.begin(), row.end() - LATENCY_SAMPLES_KEPT);
+  }
+}
+
+// Private namespace the hedged fetch writes its refs to, so it never
+// competes with the primary fetch for ref locks or FETCH_HEAD
+const std::string HEDGE_REF_PREFIX = "refs/local_mw/hedge/";
+
+/**
+ * Run a fetch, starting a second attempt if the first runs past the host's
+ * learned p95 latency, and keep whichever attempt succeeds first
+ *
+ * Hedging only starts once a host has MIN_LATENCY_SAMPLES samples, and is
+ * limited to one in HEDGE_BUDGET_RATIO fetches and MAX_CONCURRENT_HEDGES at
+ * a time so a slow host is not overloaded further.
+ *
+ * The hedge fetches origin's branches into HEDGE_REF_PREFIX without writing
+ * FETCH_HEAD. If it wins, the primary is killed (and reaped, so its locks
+ * are gone) before the hedge's refs are promoted to refs/remotes/origin/.
+ *
+ * @param repoPath The repository path
+ * @param host The git host, for latency history
+ * @param exitStatus Receives the exit status of the winning (or failing)
+ * attempt
+ * @return The output of the winning (or last failing) attempt
+ */
+std::string runHedgedFetch(const fs::path &repoPath, const std::string &host,
+                           int &exitStatus) {
+  const std::string cd = "cd \"" + repoPath.string() + "\" && ";
+  const std::string cmd = cd + "git fetch 2>&1";
+  const std::string hedgeCmd =
+      cd + "git fetch --no-tags --no-write-fetch-head origin \"+refs/heads/*:" +
+      HEDGE_REF_PREFIX + "*\" 2>&1";
+  // Drops whatever the hedge wrote, whether or not it won
+  const std::string dropHedgeRefs =
+      cd + "git for-each-ref --format=\"delete %(refname)\" " +
+      HEDGE_REF_PREFIX + " | git update-ref --stdin 2>&1";
+  using Clock = std::chrono::steady_clock;
+  std::vector<long long> samples = hostLatencySamples(host);
+  long long thresholdMs = -1;
+  if (samples.size() >= MIN_LATENCY_SAMPLES) {
+    std::vector<long long> sorted = samples;
+    std::sort(sorted.begin(), sorted.end());
+    thresholdMs = sorted[(sorted.size() * 95 + 99) / 100 - 1];
+  }
+  g_fetchesStarted++;
+
+  std::array<ChildProcess, 2> attempts;
+  Clock::time_point start = Clock::now();
+  Clock::time_point hedgeStart = start;
+  exitStatus = -1;
+  if (!startChildProcess(cmd, attempts[0])) {
+    return "error: could not start git fetch";
+  }
+  bool hedged = false;
+  int winner = -1;
+
+  while (winner < 0) {
+    std::vector<pollfd> fds;
+    std::vector<int> owners;
+    for (int i = 0; i < 2; i++) {
+      if (attempts[i].outputFd >= 0) {
+        fds.push_back({attempts[i].outputFd, POLLIN, 0});
+        owners.push_back(i);
+      }
+    }
+    if (fds.empty()) {
+      break; // Every attempt finished without success
+    }
+    poll(fds.data(), fds.size(), 100);
+    for (size_t i = 0; i < fds.size(); i++) {
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        ChildProcess &attempt = attempts[owners[i]];
+        drainChildProcess(attempt);
+        if (attempt.finished && attempt.succeeded && winner < 0) {
+          winner = owners[i];
+        }
+      }
+    }
+
+    long long elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              Clock::now() - start)
+                              .count();
+    if (!hedged && winner < 0 && thresholdMs >= 0 &&
+        elapsedMs > thresholdMs && !attempts[0].finished &&
+        gitVersionAtLeast(2, 29) &&
+        g_hedgesStarted * HEDGE_BUDGET_RATIO < g_fetchesStarted &&
+        g_hedgesRunning < MAX_CONCURRENT_HEDGES) {
+      hedged = true;
+      g_hedgesStarted++;
+      g_hedgesRunning++;
+      if (g_verbose) {
+        logVerbose("  [HEDGE] Fetch passed p95 of " +
+                   std::to_string(thresholdMs) + "ms for " + host +
+                   ", starting a second attempt");
+      }
+      hedgeStart = Clock::now();
+      startChildProcess(hedgeCmd, attempts[1]);
+    }
+  }
+
+  Clock::time_point finished = Clock::now();
+  for (auto &attempt : attempts) {
+    cancelChildProcess(attempt);
+  }
+  if (hedged) {
+    g_hedgesRunning--;
+    if (winner == 1) {
+      // The primary is gone now, so the promotion cannot race its ref
+      // updates
+      int promoteStatus = -1;
+      std::string promoteOutput = execCommand(
+          cd + "git for-each-ref --format=\"update refs/remotes/origin/" +
+              "%(refname:lstrip=3) %(objectname)\" " + HEDGE_REF_PREFIX +
+              " | git update-ref --stdin 2>&1",
+          &promoteStatus);
+      if (promoteStatus != 0) {
+        winner = -1;
+        attempts[1].output = promoteOutput;
+        attempts[1].exitStatus = promoteStatus;
+      }
+    }
+    execCommand(dropHedgeRefs);
+  }
+
+  long long elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            finished - start)
+                            .count();
+  long long unhedgedMs = elapsedMs;
+  if (winner == 1) {
+    // The primary was still running: estimate its finish from the host's
+    // history of fetches that took at least this long
+    std::vector<long long> slower;
+    for (long long sample : samples) {
+      if (sample >= elapsedMs) {
+        slower.push_back(sample);
+      }
+    }
+    if (!slower.empty()) {
+      std::sort(slower.begin(), slower.end());
+      unhedgedMs = slower[slower.size() / 2];
+    }
+  }
+  if (winner >= 0) {
+    // The history holds what fetches took, so the winner's own duration
+    Clock::time_point started = winner == 1 ? hedgeStart : start;
+    recordHostLatency(host,
+                      std::chrono::duration_cast<std::chrono::milliseconds>(
+                          finished - started)
+                          .count());
+  }
+  {
+    std::lock_guard<std::mutex> lock(g_fetchStatsMutex);
+    g_fetchStats.observedMs.push_back(elapsedMs);
+    g_fetchStats.unhedgedMs.push_back(unhedgedMs);
+    g_fetchStats.hedged += hedged ? 1 : 0;
+    g_fetchStats.hedgeWins += winner == 1 ? 1 : 0;
+  }
+
+  if (winner >= 0) {
+    exitStatus = 0;
+    return attempts[winner].output;
+  }
+  // Neither succeeded: report the primary's failure (or the hedge's, if the
+  // primary was cancelled)
+  const ChildProcess &failed =
+      attempts[0].output.empty() ? attempts[1] : attempts[0];
+  exitStatus = failed.exitStatus;
+  return failed.output;
+}
+
+/**
+ * Fetch updates from remote, retrying transient failures
+ *
+ * @param repoPath The repository path
+ * @param lockContention Optional flag set when another git process kept the
+ * repository locked
+ * @param failure Optional; receives the failure class
+ * @return true if the fetch succeeded
+ */
+bool fetchUpdates(const fs::path &repoPath, bool *lockContention = nullptr,
+                  GitFailure *failure = nullptr) {
+  std::string cmd = "cd \"" + repoPath.string() + "\" && git fetch 2>&1";
+  std::string host = g_hedge ? remoteHost(readRemoteUrl(repoPath)) : "";
+  GitFailure result;
+  runClassified(
+      [&](int &exitStatus) {
+        return g_hedge ? runHedgedFetch(repoPath, host, exitStatus)
+                       : execCommand(cmd, &exitStatus);
+      },
+      result);
+  if (lockContention) {
+    *lockContention = result == GitFailure::LockContention;
+  }
+  if (failure) {
+    *failure = result;
+  }
+  return result == GitFailure::None;
+}
+
+/**
+ * Check if local branch is behind remote
+ *
+ * @param repoPath The repository path
+ * @param branch The branch name to check
+ * @return Number of commits behind, or -1 on error
+ */
+int checkBehindCommits(const fs::path &repoPath, const std::string &branch) {
+  std::string cmd = "cd \"" + repoPath.string() +
+                    "\" && git rev-list --count HEAD..origin/" + branch +
+                    " 2>/dev/null";
+  std::string result = execCommand(cmd);
+
+  if (result.empty()) {
+    return -1; // Error or no tracking branch
+  }
+
+  try {
+    return std::stoi(result);
+  } catch (...) {
+    return -1;
+  }
+}
+
+/**
+ * Get the subjects and authors of commits on the remote branch that are not
+ * yet in HEAD, newest first
+ *
+ * Only the first `limit` commits are read, so memory stays bounded even when
+ * a repository is thousands of commits behind.
+ *
+ * @param repoPath The repository path
+ * @param branch The branch name to compare against
+ * @param limit The maximum number of commits to return
+ * @param total Receives the number of incoming commits, counted with the
+ * same filter so that it can be compared with what is returned
+ * @return Lines of the form "<short hash>\t<author>\t<subject>"
+ */
+std::vector<std::string> getIncomingCommits(const fs::path &repoPath,
+                                            const std::string &branch,
+                                            int limit, int &total) {
+  std::vector<std::string> commits;
+  const std::string cd = "cd \"" + repoPath.string() + "\" && ";
+  total = std::atoi(execCommand(cd + "git rev-list --count --no-merges "
+                                     "HEAD..origin/" +
+                                branch + " 2>/dev/null")
+                        .c_str());
+  std::string cmd = cd + "git log --no-merges --max-count=" +
+                    std::to_string(limit) +
+                    " --format=%h%x09%an%x09%s HEAD..origin/" + branch +
+                    " 2>/dev/null";
+  streamCommandLines(cmd, [&commits, limit](const std::string &line) {
+    if (static_cast<int>(commits.size()) < limit) {
+      commits.push_back(line);
+    }
+  });
+  return commits;
+}
+
+/**
+ * Look up a previously computed behind count
+ *
+ * The count is only reused when both object ids are known and equal to the
+ * ones it was computed for, so any commit, checkout or fetched update
+ * invalidates it.
+ *
+ * @param repoPath The repository path
+ * @param headOid The current HEAD object id
+ * @param upstreamOid The current upstream object id
+ * @return The cached behind count, or -1 if there is none
+ */
+int lookupBehindCache(const fs::path &repoPath, const std::string &headOid,
+                      const std::string &upstreamOid) {
+  if (headOid.empty() || upstreamOid.empty()) {
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  StateTable &cache = stateTable("behind");
+  auto it = cache.find(stateKey(repoPath));
+  if (it == cache.end() || it->second.size() < 3 ||
+      it->second[0] != headOid || it->second[1] != upstreamOid) {
+    return -1;
+  }
+  try {
+    return std::stoi(it->second[2]);
+  } catch (...) {
+    return -1;
+  }
+}
+
+/**
+ * Remember a behind count for the given HEAD and upstream object ids
+ *
+ * @param repoPath The repository path
+ * @param headOid The HEAD object id it was computed for
+ * @param upstreamOid The upstream object id it was computed for
+ * @param behindBy The behind count (errors are not cached)
+ */
+void storeBehindCache(const fs::path &repoPath, const std::string &headOid,
+                      const std::string &upstreamOid, int behindBy) {
+  if (headOid.empty() || upstreamOid.empty() || behindBy < 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  stateTable("behind")[stateKey(repoPath)] = {headOid, upstreamOid,
+                                              std::to_string(behindBy)};
+}
+
+/**
+ * Describe the state of a repository directory that decides whether it is
+ * a usable repository: its inode and mtime, the mtime of its .git entry,
+ * and the mtimes of the git directory that resolves to and of its HEAD
+ *
+ * Creating or removing .git changes the directory's mtime. A .git file
+ * ("gitdir:", as in submodules and linked worktrees) does not change when
+ * HEAD does, so the resolved git directory and HEAD (which git replaces by
+ * renaming) are stamped too.
+ *
+ * @param repoPath The repository path
+ * @return The signature, or empty string if the directory cannot be read
+ */
+std::string directorySignature(const fs::path &repoPath) {
+  auto stamp = [](const struct stat &info) {
+#ifdef __APPLE__
+    long mtimeNs = info.st_mtimespec.tv_nsec;
+#else
+    long mtimeNs = info.st_mtim.tv_nsec;
+#endif
+    return std::to_string(info.st_mtime) + "." + std::to_string(mtimeNs);
+  };
+  struct stat info;
+  if (stat(repoPath.c_str(), &info) != 0) {
+    return "";
+  }
+  std::string signature = std::to_string(info.st_ino) + ":" + stamp(info);
+  if (lstat((repoPath / ".git").c_str(), &info) == 0) {
+    signature += ":" + stamp(info);
+  }
+  fs::path gitDir = resolveGitDir(repoPath);
+  if (!gitDir.empty()) {
+    for (const fs::path &path : {gitDir, gitDir / "HEAD"}) {
+      signature += stat(path.c_str(), &info) == 0
+                       ? ":" + std::to_string(info.st_ino) + "@" + stamp(info)
+                       : std::string(":-");
+    }
+  }
+  return signature;
+}
+
+/**
+ * Drop cached negative results of directories that no longer exist
+ */
+void pruneNegativeCache() {
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  StateTable &cache = stateTable("negative");
+  std::error_code ec;
+  for (auto it = cache.begin(); it != cache.end();) {
+    it = fs::exists(it->first, ec) ? std::next(it) : cache.erase(it);
+  }
+}
+
+/**
+ * Reuse an earlier "not a repository" or branch error if the directory has
+ * not changed since; a stale entry is dropped
+ *
+ * @param repoPath The repository path
+ * @param status The status to fill in from the cache
+ * @return true if the cached result was used
+ */
+bool lookupNegativeCache(const fs::path &repoPath, RepoStatus &status) {
+  std::string signature = directorySignature(repoPath);
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  StateTable &cache = stateTable("negative");
+  auto it = cache.find(stateKey(repoPath));
+  if (it == cache.end()) {
+    return false;
+  }
+  if (signature.empty() || it->second.size() < 3 ||
+      it->second[0] != signature) {
+    cache.erase(it);
+    return false;
+  }
+  status.isRepo = it->second[1] == "1";
+  status.error = it->second[2];
+  status.negativeCached = true;
+  return true;
+}
+
+/**
+ * Remember that a directory is not a usable repository, until it changes
+ *
+ * @param repoPath The repository path
+ * @param status The status carrying the error
+ */
+void storeNegativeCache(const fs::path &repoPath, const RepoStatus &status) {
+  std::string signature = directorySignature(repoPath);
+  if (signature.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  stateTable("negative")[stateKey(repoPath)] = {
+      signature, status.isRepo ? "1" : "0", status.error};
+}
+
+/**
+ * Get a repository's upstream commit rate, measuring it from the last
+ * RATE_WINDOW_DAYS of upstream history when no recent measurement is saved
+ *
+ * @param repoPath The repository path
+ * @param branch The branch name whose upstream is measured
+ * @return Upstream commits per day, or -1 on error
+ */
+double learnCommitRate(const fs::path &repoPath, const std::string &branch) {
+  std::string key = stateKey(repoPath);
+  long long now = static_cast<long long>(std::time(nullptr));
+  {
+    std::lock_guard<std::mutex> lock(g_stateMutex);
+    StateTable &rates = stateTable("rates");
+    auto it = rates.find(key);
+    if (it != rates.end() && it->second.size() >= 2) {
+      try {
+        if (now - std::stoll(it->second[1]) < RATE_REFRESH_SECONDS) {
+          return std::stod(it->second[0]);
+        }
+      } catch (...) {
+        // Unreadable row, measure again
+      }
+    }
+  }
+
+  std::string cmd = "cd \"" + repoPath.string() +
+                    "\" && git rev-list --count --since=" +
+                    std::to_string(RATE_WINDOW_DAYS) + ".days.ago origin/" +
+                    branch + " 2>/dev/null";
+  std::string result = execCommand(cmd);
+  double rate;
+  try {
+    rate = std::stod(result) / RATE_WINDOW_DAYS;
+  } catch (...) {
+    return -1;
+  }
+
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  std::ostringstream rateText;
+  rateText << rate;
+  stateTable("rates")[key] = {rateText.str(), std::to_string(now)};
+  return rate;
+}
+
+// A commit as far as the staleness walk needs it
+struct CommitInfo {
+  long long time = 0;
+  std::vector<std::string> parents;
+};
+
+/**
+ * Read commits through the repository's cat-file co-process, skipping any
+ * already known
+ *
+ * @param repoPath The repository path
+ * @param oids The commits to read
+ * @param commits Receives the parsed commits
+ * @return false if the co-process is unavailable or a commit is missing
+ */
+bool readCommits(const fs::path &repoPath, const std::vector<std::string> &oids,
+                 std::map<std::string, CommitInfo> &commits) {
+  std::vector<std::string> commands, wanted;
+  for (const auto &oid : oids) {
+    if (!commits.count(oid)) {
+      commands.push_back("contents " + oid);
+      wanted.push_back(oid);
+    }
+  }
+  if (commands.empty()) {
+    return true;
+  }
+  std::vector<CatFileReply> replies;
+  if (!catFileQuery(repoPath, commands, replies)) {
+    return false;
+  }
+  for (size_t i = 0; i < replies.size(); i++) {
+    if (!replies[i].found || replies[i].type != "commit") {
+      return false;
+    }
+    // Only the header matters: "parent <oid>" lines and the committer's
+    // "<name> <email> <time> <zone>"
+    CommitInfo &commit = commits[wanted[i]];
+    std::istringstream header(replies[i].contents);
+    std::string line;
+    while (std::getline(header, line) && !line.empty()) {
+      if (line.compare(0, 7, "parent ") == 0) {
+        commit.parents.push_back(line.substr(7));
+      } else if (line.compare(0, 10, "committer ") == 0) {
+        size_t email = line.rfind('>');
+        if (email != std::string::npos) {
+          commit.time = std::atoll(line.c_str() + email + 1);
+        }
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Find the committer times of HEAD and of the oldest upstream commit it is
+ * missing, reading commit objects in-process
+ *
+ * Walks back from both tips newest first, like git's merge-base search,
+ * and stops once behindBy commits reachable only from the upstream have
+ * been seen (or after STALENESS_MAX_COMMITS, which leaves a lower bound).
+ * The parents of every queued commit are read in one batch, so a step of
+ * the walk costs one co-process round trip however wide the frontier is.
+ * Without a cat-file co-process a single git log is used instead.
+ *
+ * @param repoPath The repository path
+ * @param status The repository status; its headOid, upstreamOid and
+ * behindBy are read, oldestMissingTime and headCommitTime are set
+ */
+void measureStaleness(const fs::path &repoPath, RepoStatus &status) {
+  std::map<std::string, CommitInfo> commits;
+  if (!readCommits(repoPath, {status.headOid, status.upstreamOid}, commits)) {
+    std::string output =
+        execCommand("cd \"" + repoPath.string() + "\" && (git log -1 " +
+                    "--format=%ct " + status.headOid + " && git log " +
+                    "--format=%ct " + status.headOid + ".." +
+                    status.upstreamOid + ") 2>/dev/null");
+    std::istringstream times(output);
+    long long time;
+    if (times >> time) {
+      status.headCommitTime = time;
+    }
+    while (times >> time) {
+      status.oldestMissingTime = status.oldestMissingTime
+                                     ? std::min(status.oldestMissingTime, time)
+                                     : time;
+    }
+    return;
+  }
+  status.headCommitTime = commits[status.headOid].time;
+
+  // Bit 1: reachable from the upstream, bit 2: reachable from HEAD
+  std::map<std::string, int> flags = {{status.upstreamOid, 1}};
+  flags[status.headOid] |= 2;
+  std::priority_queue<std::pair<long long, std::string>> queue;
+  // Parents of queued commits that have not been read yet
+  std::set<std::string> unread;
+  auto enqueue = [&](const std::string &oid) {
+    const CommitInfo &commit = commits[oid];
+    queue.push({commit.time, oid});
+    for (const auto &parent : commit.parents) {
+      if (!commits.count(parent)) {
+        unread.insert(parent);
+      }
+    }
+  };
+  enqueue(status.upstreamOid);
+  enqueue(status.headOid);
+  std::map<std::string, int> walked;
+  int missing = 0, read = 0;
+  while (!queue.empty() && missing < status.behindBy &&
+         read < STALENESS_MAX_COMMITS) {
+    std::string oid = queue.top().second;
+    queue.pop();
+    int flag = flags[oid];
+    if (walked[oid] == flag) {
+      continue;
+    }
+    walked[oid] = flag;
+    read++;
+    const CommitInfo &commit = commits[oid];
+    if (flag == 1) {
+      missing++;
+      status.oldestMissingTime =
+          status.oldestMissingTime
+              ? std::min(status.oldestMissingTime, commit.time)
+              : commit.time;
+    }
+    bool parentsKnown = std::all_of(
+        commit.parents.begin(), commit.parents.end(),
+        [&](const std::string &parent) { return commits.count(parent); });
+    if (!parentsKnown) {
+      unread.insert(commit.parents.begin(), commit.parents.end());
+      std::vector<std::string> batch(unread.begin(), unread.end());
+      unread.clear();
+      // A missing commit elsewhere in the frontier (a shallow boundary)
+      // only ends the walk once it is actually reached
+      if (!readCommits(repoPath, batch, commits) &&
+          !readCommits(repoPath, commit.parents, commits)) {
+        return;
+      }
+    }
+    for (const auto &parent : commit.parents) {
+      if ((flags[parent] | flag) != flags[parent]) {
+        flags[parent] |= flag;
+        enqueue(parent);
+      }
+    }
+  }
+}
+
+/**
+ * Count the files an update from one commit to another changes
+ *
+ * @param repoPath The repository path
+ * @param fromOid The commit the checkout is at
+ * @param toOid The commit it would be updated to
+ * @return The number of files changed since their merge base, or -1
+ */
+int countChangedFiles(const fs::path &repoPath, const std::string &fromOid,
+                      const std::string &toOid) {
+  std::string output = execCommand("cd \"" + repoPath.string() +
+                                   "\" && git diff --shortstat " + fromOid +
+                                   "..." + toOid + " 2>/dev/null");
+  // " 3 files changed, 10 insertions(+)", or nothing if none changed
+  return output.empty() ? 0 : std::atoi(output.c_str());
+}
+
+/**
+ * Read a field of a repository's "phases" row
+ *
+ * @param repoPath The repository path
+ * @param field One of the PHASE_* fields
+ * @return The recorded value, or -1 if none is recorded
+ */
+double readPhase(const fs::path &repoPath, size_t field) {
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  StateTable &phases = stateTable("phases");
+  auto it = phases.find(stateKey(repoPath));
+  if (it == phases.end() || field >= it->second.size() ||
+      it->second[field].empty()) {
+    return -1;
+  }
+  return std::atof(it->second[field].c_str());
+}
+
+/**
+ * Remember a phase measurement of a repository, smoothed with earlier runs
+ * like the check timings
+ *
+ * @param repoPath The repository path
+ * @param field One of the PHASE_* fields
+ * @param value The measurement
+ */
+void recordPhase(const fs::path &repoPath, size_t field, double value) {
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  std::vector<std::string> &row = stateTable("phases")[stateKey(repoPath)];
+  row.resize(std::max(row.size(), PHASE_LARGE_UPDATE_FILES + 1));
+  if (!row[field].empty()) {
+    value = 0.5 * value + 0.5 * std::atof(row[field].c_str());
+  }
+  std::ostringstream oss;
+  oss << std::fixed << std::setprecision(3) << value;
+  row[field] = oss.str();
+}
+
+/**
+ * Predict how long an update changing some number of files takes, from a
+ * repository's recorded update timings
+ *
+ * A recorded time is split into a fixed part (at most
+ * DEFAULT_UPDATE_SECONDS) and a per-file part, which is scaled to the
+ * number of files.
+ *
+ * @param repoPath The repository path
+ * @param field PHASE_UPDATE or PHASE_LARGE_UPDATE
+ * @param files The number of files the update changes
+ * @return The predicted seconds, or -1 if nothing is recorded
+ */
+double predictUpdateSeconds(const fs::path &repoPath, size_t field,
+                            int files) {
+  double recorded = readPhase(repoPath, field);
+  if (recorded < 0) {
+    return -1;
+  }
+  double fixed = std::min(recorded, DEFAULT_UPDATE_SECONDS);
+  double timedFiles = std::max(1.0, readPhase(repoPath, field + 1));
+  return fixed + (recorded - fixed) / timedFiles * files;
+}
+
+/**
+ * Assign every repository a fetch interval from its upstream commit rate
+ *
+ * A repository is fetched about twice per expected upstream commit, within
+ * MIN_FETCH_INTERVAL and MAX_FETCH_INTERVAL. Repositories with an unknown
+ * rate get the maximum interval. If the resulting fetches per hour exceed
+ * --fetch-budget, all intervals are stretched by the same factor.
+ *
+ * @param results The repository statuses to schedule
+ */
+void assignFetchIntervals(std::vector<RepoStatus> &results) {
+  double fetchesPerHour = 0;
+  for (auto &status : results) {
+    if (!status.isRepo) {
+      status.fetchInterval = 0;
+      continue;
+    }
+    double interval = MAX_FETCH_INTERVAL;
+    if (status.commitsPerDay > 0) {
+      interval = 24.0 * 60 * 60 / (2 * status.commitsPerDay);
+    }
+    interval = std::max<double>(MIN_FETCH_INTERVAL,
+                                std::min<double>(MAX_FETCH_INTERVAL, interval));
+    status.fetchInterval = static_cast<int>(interval);
+    fetchesPerHour += 3600.0 / interval;
+  }
+
+  if (g_fetchBudget > 0 && fetchesPerHour > g_fetchBudget) {
+    double stretch = fetchesPerHour / g_fetchBudget;
+    for (auto &status : results) {
+      status.fetchInterval =
+          static_cast<int>(std::ceil(status.fetchInterval * stretch));
+    }
+  }
+}
+
+// Incremental SHA-1, for checking loose object ids and pack checksums
+// without holding the hashed bytes in memory
+struct Sha1 {
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                   0xC3D2E1F0};
+  unsigned char block[64];
+  size_t blockUsed = 0;
+  uint64_t length = 0;
+
+  /**
+   * Hash more bytes
+   *
+   * @param data The bytes
+   * @param size How many bytes
+   */
+  void update(const char *data, size_t size) {
+    length += size;
+    while (size > 0) {
+      size_t take = std::min(size, sizeof(block) - blockUsed);
+      std::memcpy(block + blockUsed, data, take);
+      blockUsed += take;
+      data += take;
+      size -= take;
+      if (blockUsed == sizeof(block)) {
+        compress();
+        blockUsed = 0;
+      }
+    }
+  }
+
+  /**
+   * Finish hashing; the object cannot be updated afterwards
+   *
+   * @return The digest as 40 lowercase hex characters
+   */
+  std::string hexDigest() {
+    uint64_t bitLength = length * 8;
+    const char pad = static_cast<char>(0x80);
+    update(&pad, 1);
+    const char zero = '\0';
+    while (blockUsed != 56) {
+      update(&zero, 1);
+    }
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      const char byte = static_cast<char>((bitLength >> shift) & 0xff);
+      update(&byte, 1);
+    }
+
+    std::ostringstream oss;
+    for (uint32_t word : h) {
+      oss << std::hex << std::setw(8) << std::setfill('0') << word;
+    }
+    return oss.str();
+  }
+
+  // Mix one full block into the state
+  void compress() {
+    auto rotl = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+      const unsigned char *p = block + i * 4;
+      w[i] = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+             (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+    }
+    for (int i = 16; i < 80; i++) {
+      w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rotl(b, 30);
+      b = a;
+      a = temp;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+};
+
+// Shared token bucket for --io-budget: verifiers take each chunk's byte count
+// out of it before reading the chunk and sleep off any debt
+std::mutex g_ioBudgetMutex;
+double g_ioBudgetTokens = 0;
+std::chrono::steady_clock::time_point g_ioBudgetRefilled =
+    std::chrono::steady_clock::now();
+
+/**
+ * Wait until reading the given number of bytes fits in the I/O budget
+ *
+ * @param bytes The number of bytes about to be read
+ */
+void acquireIoBudget(long long bytes) {
+  if (g_ioBudget <= 0) {
+    return;
+  }
+  double rate = static_cast<double>(g_ioBudget) * 1024 * 1024;
+  double debt;
+  {
+    std::lock_guard<std::mutex> lock(g_ioBudgetMutex);
+    auto now = std::chrono::steady_clock::now();
+    double elapsed =
+        std::chrono::duration<double>(now - g_ioBudgetRefilled).count();
+    g_ioBudgetRefilled = now;
+    // Idle time banks at most one second of reading, so a burst is that
+    // plus the chunk being charged
+    g_ioBudgetTokens = std::min(rate, g_ioBudgetTokens + elapsed * rate);
+    g_ioBudgetTokens -= static_cast<double>(bytes);
+    debt = -g_ioBudgetTokens;
+  }
+  if (debt > 0) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(debt / rate));
+  }
+}
+
+// Totals for the verification summary
+std::atomic<int> g_verifiedPacks{0};
+std::atomic<int> g_verifiedLooseObjects{0};
+std::atomic<long long> g_verifiedBytes{0};
+
+/**
+ * Check loose objects by reading them through `git cat-file --batch` and
+ * rehashing their contents as they stream in, charging each object's size
+ * on disk to the I/O budget before it is read
+ *
+ * @param repoPath The repository path
+ * @param objects The object ids to check, with their sizes on disk
+ * @param problem Receives a description of the first bad object
+ * @return false if an object is missing, unreadable or hashes differently
+ */
+bool verifyLooseObjects(
+    const fs::path &repoPath,
+    const std::vector<std::pair<std::string, long long>> &objects,
+    std::string &problem) {
+  char listPath[] = "/tmp/local_mw-verify-XXXXXX";
+  int listFd = mkstemp(listPath);
+  if (listFd < 0) {
+    problem = "could not create a temporary file";
+    return false;
+  }
+  std::string list;
+  for (const auto &object : objects) {
+    list += object.first + "\n";
+  }
+  bool written = write(listFd, list.data(), list.size()) ==
+                 static_cast<ssize_t>(list.size());
+  close(listFd);
+
+  // Read directly rather than through execCommand, which would log every
+  // object's contents in verbose mode
+  std::string cmd = "cd \"" + repoPath.string() +
+                    "\" && git cat-file --batch < \"" + listPath +
+                    "\" 2>/dev/null";
+  if (g_verbose) {
+    logVerbose("  [CMD] " + cmd);
+  }
+  FILE *pipe = written ? openCommand(cmd) : nullptr;
+  if (!pipe) {
+    unlink(listPath);
+    problem = "could not read objects";
+    return false;
+  }
+
+  std::vector<char> chunk(VERIFY_CHUNK_BYTES);
+  bool intact = true;
+  for (const auto &object : objects) {
+    const std::string &oid = object.first;
+    acquireIoBudget(object.second);
+    std::string header;
+    int c;
+    while ((c = fgetc(pipe)) != EOF && c != '\n') {
+      header += static_cast<char>(c);
+    }
+    std::istringstream fields(header);
+    std::string gotOid, objectType;
+    size_t size = 0;
+    if (c == EOF || !(fields >> gotOid >> objectType >> size) ||
+        gotOid != oid) {
+      problem = "unreadable object " + oid;
+      intact = false;
+      break;
+    }
+    Sha1 hash;
+    std::string prefix = objectType + " " + std::to_string(size) + '\0';
+    hash.update(prefix.data(), prefix.size());
+    size_t remaining = size;
+    while (remaining > 0) {
+      size_t got =
+          fread(chunk.data(), 1, std::min(remaining, chunk.size()), pipe);
+      if (got == 0) {
+        break;
+      }
+      hash.update(chunk.data(), got);
+      remaining -= got;
+    }
+    if (remaining > 0 || fgetc(pipe) != '\n') {
+      problem = "unreadable object " + oid;
+      intact = false;
+      break;
+    }
+    // SHA-256 repositories are only checked for readability
+    if (oid.size() == 40 && hash.hexDigest() != oid) {
+      problem = "object " + oid + " does not match its id";
+      intact = false;
+      break;
+    }
+  }
+  pclose(pipe);
+  unlink(listPath);
+  return intact;
+}
+
+/**
+ * Read a pack through the I/O budget one chunk at a time and compare it
+ * with the checksum at its end; this also leaves it in the page cache for
+ * `git verify-pack`
+ *
+ * @param packPath The .pack file
+ * @param problem Receives a description of what is wrong
+ * @return false if the pack could not be read or its checksum differs
+ */
+bool checkPackChecksum(const fs::path &packPath, std::string &problem) {
+  int fd = open(packPath.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    problem = "could not be read";
+    return false;
+  }
+  // Packs are named after their checksum; SHA-256 ones are only read
+  const std::string name = packPath.stem().string();
+  const bool sha1 = name.size() == 45;
+  const off_t trailer = 20;
+  const off_t size = info.st_size;
+
+  Sha1 hash;
+  std::string stored;
+  std::vector<char> chunk(VERIFY_CHUNK_BYTES);
+  off_t offset = 0;
+  while (offset < size) {
+    size_t wanted =
+        static_cast<size_t>(std::min<off_t>(chunk.size(), size - offset));
+    acquireIoBudget(static_cast<long long>(wanted));
+    ssize_t got = read(fd, chunk.data(), wanted);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      break;
+    }
+    // The trailer is the checksum, not part of what it covers
+    off_t covered =
+        std::min<off_t>(got, std::max<off_t>(0, size - trailer - offset));
+    hash.update(chunk.data(), static_cast<size_t>(covered));
+    stored.append(chunk.data() + covered, static_cast<size_t>(got - covered));
+    offset += got;
+  }
+  close(fd);
+  if (offset < size) {
+    problem = "could not be read";
+    return false;
+  }
+  if (!sha1) {
+    return true;
+  }
+  std::ostringstream storedHex;
+  for (unsigned char byte : stored) {
+    storedHex << std::hex << std::setw(2) << std::setfill('0')
+              << static_cast<int>(byte);
+  }
+  if (size < trailer || storedHex.str() != hash.hexDigest()) {
+    problem = "pack checksum does not match";
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Verify the packs and loose objects added to a repository since its last
+ * clean verification, under the shared I/O budget
+ *
+ * Packs are checked with `git verify-pack`, which checks every object and
+ * the pack checksum. Anything verified before is trusted, so a first run
+ * verifies everything and later runs only what fetches and pulls added.
+ *
+ * @param repoPath The repository path
+ * @param problem Receives a description of the corruption found
+ * @return false if corruption was found
+ */
+bool verifyNewObjects(const fs::path &repoPath, std::string &problem) {
+  fs::path gitDir = resolveGitDir(repoPath);
+  if (gitDir.empty()) {
+    return true;
+  }
+  fs::path objectsDir = resolveCommonDir(gitDir) / "objects";
+  const std::string key = stateKey(repoPath);
+
+  time_t since = 0;
+  {
+    std::lock_guard<std::mutex> lock(g_stateMutex);
+    StateTable &verified = stateTable("verified");
+    auto it = verified.find(key);
+    if (it != verified.end() && !it->second.empty()) {
+      since = std::atoll(it->second[0].c_str());
+    }
+  }
+  time_t started = time(nullptr);
+
+  auto modifiedSince = [since](const fs::path &path, long long *size) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0 || info.st_mtime < since) {
+      return false;
+    }
+    if (size) {
+      *size = info.st_size;
+    }
+    return true;
+  };
+
+  std::error_code ec;
+  for (const auto &entry : fs::directory_iterator(objectsDir / "pack", ec)) {
+    long long size = 0;
+    if (entry.path().extension() != ".pack" ||
+        !modifiedSince(entry.path(), &size)) {
+      continue;
+    }
+    g_verifiedPacks++;
+    g_verifiedBytes += size;
+    if (!checkPackChecksum(entry.path(), problem)) {
+      problem = entry.path().filename().string() + ": " + problem;
+      return false;
+    }
+    fs::path index = entry.path();
+    index.replace_extension(".idx");
+    std::string output = execCommand("cd \"" + repoPath.string() +
+                                     "\" && git verify-pack \"" +
+                                     index.string() +
+                                     "\" 2>&1 >/dev/null && echo OK");
+    if (output.rfind("OK\n") == std::string::npos) {
+      std::string firstLine = output.substr(0, output.find('\n'));
+      problem = entry.path().filename().string() +
+                (firstLine.empty() ? "" : ": " + firstLine);
+      return false;
+    }
+  }
+
+  std::vector<std::pair<std::string, long long>> looseObjects;
+  long long looseBytes = 0;
+  auto isHex = [](const std::string &text) {
+    return std::all_of(text.begin(), text.end(), [](char c) {
+      return std::isxdigit(static_cast<unsigned char>(c)) != 0;
+    });
+  };
+  for (const auto &fanout : fs::directory_iterator(objectsDir, ec)) {
+    std::string prefix = fanout.path().filename().string();
+    // Adding an object touches its fan-out directory, so untouched
+    // directories cannot hold anything new
+    if (prefix.size() != 2 || !isHex(prefix) ||
+        !modifiedSince(fanout.path(), nullptr)) {
+      continue;
+    }
+    for (const auto &object : fs::directory_iterator(fanout.path(), ec)) {
+      // The rest of a SHA-1 (or SHA-256) id; anything else, like the
+      // tmp_obj_* of a write in progress, is not an object
+      std::string rest = object.path().filename().string();
+      long long size = 0;
+      if ((rest.size() == 38 || rest.size() == 62) && isHex(rest) &&
+          modifiedSince(object.path(), &size)) {
+        looseObjects.emplace_back(prefix + rest, size);
+        looseBytes += size;
+      }
+    }
+  }
+  if (!looseObjects.empty()) {
+    g_verifiedLooseObjects += static_cast<int>(looseObjects.size());
+    g_verifiedBytes += looseBytes;
+    if (!verifyLooseObjects(repoPath, looseObjects, problem)) {
+      return false;
+    }
+  }
+
+  // Only a clean run moves the mark, so corruption keeps being reported
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  stateTable("verified")[key] = {std::to_string(started)};
+  return true;
+}
+
+/**
+ * Get the backoff a repository is serving after permanent fetch failures
+ *
+ * @param repoPath The repository path
+ * @return A description of the backoff, or empty string if there is none
+ */
+std::string activeBackoff(const fs::path &repoPath) {
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  StateTable &backoffs = stateTable("backoff");
+  auto it = backoffs.find(stateKey(repoPath));
+  if (it == backoffs.end() || it->second.size() < 3) {
+    return "";
+  }
+  long long until = std::atoll(it->second[2].c_str());
+  long long now = static_cast<long long>(time(nullptr));
+  if (until <= now) {
+    return "";
+  }
+  return "Backing off after " + it->second[0] + " (retry in " +
+         formatDuration(until - now) + ")";
+}
+
+/**
+ * Update a repository's backoff after a fetch: permanent failures extend
+ * it, anything else clears it
+ *
+ * @param repoPath The repository path
+ * @param failure The fetch's failure class
+ */
+void recordFetchOutcome(const fs::path &repoPath, GitFailure failure) {
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  StateTable &backoffs = stateTable("backoff");
+  const std::string key = stateKey(repoPath);
+  if (failure == GitFailure::None || failure == GitFailure::LockContention ||
+      isTransientFailure(failure)) {
+    backoffs.erase(key);
+    return;
+  }
+  int repeats = 0;
+  auto it = backoffs.find(key);
+  if (it != backoffs.end() && it->second.size() >= 2) {
+    repeats = std::atoi(it->second[1].c_str());
+  }
+  long long delay =
+      std::min<long long>(MAX_PERMANENT_BACKOFF_SECONDS,
+                          static_cast<long long>(PERMANENT_BACKOFF_SECONDS)
+                              << std::min(repeats, 16));
+  backoffs[key] = {describeFailure(failure), std::to_string(repeats + 1),
+                   std::to_string(static_cast<long long>(time(nullptr)) +
+                                  delay)};
+}
+
+/**
+ * Check if repository has uncommitted changes
+ *
+ * @param repoPath The repository path
+ * @return true if there are uncommitted changes, false otherwise
+ */
+bool hasUncommittedChanges(const fs::path &repoPath) {
+  std::string cmd =
+      "cd \"" + repoPath.string() + "\" && git status --porcelain 2>/dev/null";
+  std::string result = execCommand(cmd);
+  return !result.empty();
+}
+
+/**
+ * Get the update strategy for a repository: its --strategy-rules entry if
+ * it has one, otherwise --update-strategy
+ *
+ * @param type The repository type
+ * @param name The repository name
+ * @return "pull", "autostash" or "rebase"
+ */
+std::string updateStrategyFor(const std::string &type,
+                              const std::string &name) {
+  const std::vector<std::string> *rule =
+      findRepoRule(g_strategyRules, type, name);
+  return rule && !rule->empty() ? (*rule)[0] : g_updateStrategy;
+}
+
+/**
+ * Update a checkout to its already fetched upstream without a human:
+ * local changes are stashed, HEAD is fast-forwarded ("autostash") or local
+ * commits are rebased ("rebase"), and the changes are restored
+ *
+ * The update is all or nothing. If the rebase or restoring the local
+ * changes conflicts, HEAD, the index and the working tree are put back
+ * exactly as they were before.
+ *
+ * @param repoPath The repository path
+ * @param strategy "autostash" or "rebase"
+ * @param errorMsg Receives a description of what went wrong
+ * @param lockContention Optional flag set when a lock blocked a step
+ * @return true if the checkout was updated
+ */
+bool updateWithStrategy(const fs::path &repoPath, const std::string &strategy,
+                        std::string &errorMsg,
+                        bool *lockContention = nullptr) {
+  const std::string cd = "cd \"" + repoPath.string() + "\" && ";
+  auto git = [&](const std::string &args, GitFailure &failure) {
+    return runClassified(
+        [&](int &exitStatus) {
+          return execCommand(cd + "git " + args + " 2>&1", &exitStatus);
+        },
+        failure);
+  };
+  std::string branch = getCurrentBranch(repoPath);
+  std::string origHead = resolveRefOid(repoPath, "HEAD");
+  if (branch.empty() || branch == "HEAD" || origHead.empty()) {
+    errorMsg = "Not on a branch";
+    return false;
+  }
+
+  GitFailure failure;
+  std::string stashBefore = resolveRefOid(repoPath, "refs/stash");
+  if (hasUncommittedChanges(repoPath)) {
+    git("stash push -m \"local_mw autostash\"", failure);
+    if (failure != GitFailure::None) {
+      if (lockContention) {
+        *lockContention = failure == GitFailure::LockContention;
+      }
+      errorMsg = "Could not stash local changes: " + describeFailure(failure);
+      return false;
+    }
+  }
+  std::string stash = resolveRefOid(repoPath, "refs/stash");
+  bool stashed = !stash.empty() && stash != stashBefore;
+
+  // Put everything back as it was: drop any half-done rebase, return to the
+  // original commit and re-apply the stash (which was made on top of it,
+  // so it applies cleanly)
+  auto rollBack = [&](const std::string &reason) {
+    GitFailure ignored;
+    execCommand(cd + "git rebase --abort 2>&1");
+    git("reset -q --hard " + origHead, ignored);
+    if (stashed) {
+      git("stash pop -q --index", ignored);
+      if (ignored != GitFailure::None) {
+        git("stash pop -q", ignored);
+      }
+    }
+    errorMsg = reason + ", rolled back" +
+               (ignored == GitFailure::None
+                    ? ""
+                    : " (local changes kept in the stash)");
+    if (g_verbose) {
+      logVerbose("  [ROLLBACK] " + errorMsg);
+    }
+    return false;
+  };
+
+  std::string upstream = "origin/" + branch;
+  git((strategy == "rebase" ? "rebase -q " : "merge -q --ff-only ") +
+          upstream,
+      failure);
+  if (failure != GitFailure::None) {
+    if (lockContention) {
+      *lockContention = failure == GitFailure::LockContention;
+    }
+    return rollBack(strategy == "rebase"
+                        ? "Local commits conflict with upstream"
+                        : "Not a fast-forward: " + describeFailure(failure));
+  }
+  if (stashed) {
+    // Restore staged changes as staged where possible; a conflicting pop
+    // leaves the stash in place for rollBack() to re-apply
+    git("stash pop -q --index", failure);
+    if (failure != GitFailure::None) {
+      git("stash pop -q", failure);
+    }
+    if (failure != GitFailure::None) {
+      return rollBack("Local changes conflict with upstream");
+    }
+  }
+  return true;
+}
+
+/**
+ * Apply a large fast-forward to a clean checkout in two steps instead of
+ * one git pull
+ *
+ * First the added and modified files are checked out from the fetched
+ * upstream with parallel checkout workers (git 2.32+), which also brings
+ * the index up to date. Then `git merge --ff-only` moves HEAD; with the
+ * index already matching, it only removes deleted files. A site served
+ * from the checkout never sees a file removed before its replacement
+ * exists.
+ *
+ * Dirty checkouts, non-fast-forwards, untracked files in the way and
+ * changes below LARGE_FASTFORWARD_FILES are left to the normal path.
+ *
+ * @param repoPath The repository path
+ * @param errorMsg Receives a description of what went wrong
+ * @param attempted Set when the fast path was taken
+ * @param lockContention Optional flag set when another git process kept the
+ * repository locked
+ * @return true if the checkout was updated
+ */
+bool largeFastForward(const fs::path &repoPath, std::string &errorMsg,
+                      bool &attempted, bool *lockContention = nullptr) {
+  attempted = false;
+  // checkout.workers needs 2.32; older git would check out serially
+  if (!gitVersionAtLeast(2, 32)) {
+    return false;
+  }
+  std::string branch = getCurrentBranch(repoPath);
+  std::string headOid = resolveRefOid(repoPath, "HEAD");
+  std::string upstreamOid =
+      resolveRefOid(repoPath, "refs/remotes/origin/" + branch);
+  if (headOid.empty() || upstreamOid.empty() || headOid == upstreamOid) {
+    return false;
+  }
+  const std::string cd = "cd \"" + repoPath.string() + "\" && ";
+  std::string changes =
+      execCommand(cd + "git diff --name-status -z --no-renames " + headOid +
+                  " " + upstreamOid + " 2>/dev/null");
+  // NUL-separated "<status>" "<path>" pairs
+  std::vector<std::string> fields;
+  for (size_t pos = 0; pos < changes.size();) {
+    size_t end = changes.find('\0', pos);
+    if (end == std::string::npos) {
+      break;
+    }
+    fields.push_back(changes.substr(pos, end - pos));
+    pos = end + 1;
+  }
+  int files = static_cast<int>(fields.size() / 2);
+  if (files < LARGE_FASTFORWARD_FILES) {
+    return false;
+  }
+  std::string written;
+  for (size_t i = 0; i + 1 < fields.size(); i += 2) {
+    if (fields[i] == "D") {
+      continue;
+    }
+    // An untracked file where a new one goes would be silently replaced;
+    // git pull refuses instead, so let it
+    struct stat info;
+    if (fields[i] == "A" &&
+        lstat((repoPath / fields[i + 1]).c_str(), &info) == 0) {
+      return false;
+    }
+    written += fields[i + 1] + '\0';
+  }
+  if (hasUncommittedChanges(repoPath)) {
+    return false;
+  }
+  int exitStatus = 0;
+  execCommand(cd + "git merge-base --is-ancestor " + headOid + " " +
+                  upstreamOid + " 2>/dev/null",
+              &exitStatus);
+  if (exitStatus != 0) {
+    return false;
+  }
+
+  char listPath[] = "/tmp/local_mw-checkout-XXXXXX";
+  int listFd = mkstemp(listPath);
+  if (listFd < 0) {
+    return false;
+  }
+  bool listed = write(listFd, written.data(), written.size()) ==
+                static_cast<ssize_t>(written.size());
+  close(listFd);
+  if (!listed) {
+    unlink(listPath);
+    return false;
+  }
+  attempted = true;
+  if (g_verbose) {
+    logVerbose("  [FAST PATH] Large fast-forward (" + std::to_string(files) +
+               " files), using parallel checkout");
+  }
+
+  auto started = std::chrono::steady_clock::now();
+  GitFailure failure;
+  std::string output = runClassified(
+      [&](int &exitStatus) {
+        // Paths are file names, not patterns: "*" or ":" in one must not
+        // match other files
+        return execCommand(cd +
+                               "git --literal-pathspecs "
+                               "-c checkout.workers=0 checkout -q " +
+                               upstreamOid + " --pathspec-file-nul " +
+                               "--pathspec-from-file=\"" + listPath +
+                               "\" 2>&1",
+                           &exitStatus);
+      },
+      failure);
+  unlink(listPath);
+  if (failure == GitFailure::None) {
+    output = runClassified(
+        [&](int &exitStatus) {
+          return execCommand(cd + "git merge -q --ff-only " + upstreamOid +
+                                 " 2>&1",
+                             &exitStatus);
+        },
+        failure);
+  }
+  if (lockContention) {
+    *lockContention = failure == GitFailure::LockContention;
+  }
+  if (failure != GitFailure::None) {
+    // The checkout was clean, so this restores it exactly. It can fail on
+    // the same lock as the merge, and then the new files stay in place.
+    GitFailure resetFailure;
+    runClassified(
+        [&](int &exitStatus) {
+          return execCommand(cd + "git reset -q --hard " + headOid + " 2>&1",
+                             &exitStatus);
+        },
+        resetFailure);
+    errorMsg = (failure == GitFailure::Other ? output
+                                             : describeFailure(failure)) +
+               (resetFailure == GitFailure::None
+                    ? " (rolled back)"
+                    : " (left mid-update: files are at " +
+                          upstreamOid.substr(0, 12) + ", HEAD at " +
+                          headOid.substr(0, 12) + "; roll back failed: " +
+                          describeFailure(resetFailure) + ")");
+    return false;
+  }
+
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - started)
+                       .count();
+  if (g_verbose) {
+    std::ostringstream oss;
+    oss << "  [FAST PATH] " << files << " files in " << std::fixed
+        << std::setprecision(1) << seconds << "s";
+    double normal = predictUpdateSeconds(repoPath, PHASE_UPDATE, files);
+    if (normal >= 0) {
+      oss << " (normal path about " << normal << "s at its recorded rate)";
+    }
+    logVerbose(oss.str());
+  }
+  recordPhase(repoPath, PHASE_LARGE_UPDATE, seconds);
+  recordPhase(repoPath, PHASE_LARGE_UPDATE_FILES, files);
+  return true;
+}
+
+/**
+ * Performs a git pull operation on the specified repository.
+ *
+ * @param repoPath The filesystem path to the git repository.
+ * @param errorMsg Reference to a string that will contain error output if the
+ * operation fails.
+ * @param lockContention Optional flag set when another git process kept the
+ * repository locked.
+ * @param strategy "pull" for a plain git pull, or an unattended strategy
+ * handled by updateWithStrategy().
+ * @return true if git pull succeeded (judged by its exit status), false
+ * otherwise.
+ */
+bool performGitPull(const fs::path &repoPath, std::string &errorMsg,
+                    bool *lockContention = nullptr,
+                    const std::string &strategy = "pull") {
+  if (strategy != "pull") {
+    return updateWithStrategy(repoPath, strategy, errorMsg, lockContention);
+  }
+  bool attempted = false;
+  bool updated =
+      largeFastForward(repoPath, errorMsg, attempted, lockContention);
+  if (attempted) {
+    return updated;
+  }
+  std::string cmd = "cd \"" + repoPath.string() + "\" && git pull 2>&1";
+  GitFailure failure;
+  std::string output = runClassified(
+      [&cmd](int &exitStatus) { return execCommand(cmd, &exitStatus); },
+      failure);
+  if (lockContention) {
+    *lockContention = failure == GitFailure::LockContention;
+  }
+
+  if (failure != GitFailure::None) {
+    // Known failures get a short description; anything else keeps git's
+    // own output
+    errorMsg = failure == GitFailure::Other ? output : describeFailure(failure);
+    return false;
+  }
+
+  return true;
+}
+
+// Progress of the current checkRepositories() call. Workers only touch
+// atomics here; the renderer thread reads them to draw the display.
+struct ProgressState {
+  size_t total = 0;
+  size_t workers = 1;
+  std::chrono::steady_clock::time_point startTime;
+  std::atomic<size_t> fetched{0};
+  std::atomic<size_t> pulled{0};
+  std::atomic<size_t> running{0};
+  std::atomic<size_t> finished{0};
+  // Per repository: ms since startTime when it started (0 if not yet,
+  // -1 once finished), and its expected duration from earlier runs
+  std::vector<std::atomic<long long>> startedAtMs;
+  std::vector<double> expectedSeconds;
+};
+
+ProgressState *g_progress = nullptr;
+
+/**
+ * Check a repository for updates and optionally pull
+ *
+ * @param repoPath The repository path
+ * @param type The type of repository (core, extension, skin)
+ * @return The repository status
+ */
+RepoStatus checkRepository(const fs::path &repoPath, const std::string &type) {
+  if (g_verbose) {
+    std::ostringstream oss;
+    oss << "\n[CHECKING] " << repoPath.filename().string() << " (" << type
+        << ")\n";
+    oss << "  Path: " << repoPath.string() << "\n";
+    logVerbose(oss.str());
+  }
+
+  // Object and ref questions about this repository share one co-process
+  CatFileScope catFile(repoPath);
+
+  RepoStatus status;
+  status.path = repoPath;
+  status.name = repoPath.filename().string();
+  status.type = type;
+  status.hasUpdates = false;
+  status.behindBy = 0;
+  status.pulled = false;
+  status.hadUncommittedChanges = false;
+
+  // Directories that were not usable repositories last time cost nothing
+  // until they change
+  if (lookupNegativeCache(repoPath, status)) {
+    if (g_verbose) {
+      logVerbose("  [CACHE] Unchanged since last run: " + status.error);
+    }
+    return status;
+  }
+
+  status.isRepo = isGitRepo(repoPath);
+  if (!status.isRepo) {
+    status.error = "Not a git repository";
+    storeNegativeCache(repoPath, status);
+    if (g_verbose) {
+      logVerbose("  [SKIP] Not a git repository");
+    }
+    return status;
+  }
+
+  // Get current branch
+  if (g_verbose) {
+    logVerbose("  [STEP] Getting current branch...");
+  }
+  status.currentBranch = getCurrentBranch(repoPath);
+  if (status.currentBranch.empty()) {
+    status.error = "Could not determine branch";
+    storeNegativeCache(repoPath, status);
+    if (g_verbose) {
+      logVerbose("  [ERROR] Could not determine branch");
+    }
+    return status;
+  }
+  if (g_verbose) {
+    logVerbose("  [INFO] Current branch: " + status.currentBranch);
+  }
+
+  // The uncommitted changes check only reads the working tree, so it runs
+  // alongside the fetch instead of after it
+  std::future<bool> uncommittedProbe;
+  if (g_needDirty) {
+    if (g_verbose) {
+      logVerbose("  [STEP] Checking for uncommitted changes...");
+    }
+    uncommittedProbe =
+        std::async(std::launch::async, hasUncommittedChanges, repoPath);
+  }
+  status.headOid = resolveRefOid(repoPath, "HEAD");
+
+  // Nothing asked for needs the network
+  if (!g_needFetch) {
+    status.hadUncommittedChanges =
+        uncommittedProbe.valid() && uncommittedProbe.get();
+    return status;
+  }
+
+  // Fetch updates
+  if (g_verbose) {
+    logVerbose("  [STEP] Fetching updates from remote...");
+  }
+  // The daemon leaves repositories alone for a while after a permanent
+  // failure instead of failing on them every sweep
+  std::string backoff = g_daemon ? activeBackoff(repoPath) : "";
+  if (!backoff.empty()) {
+    status.hadUncommittedChanges =
+        uncommittedProbe.valid() && uncommittedProbe.get();
+    status.error = backoff;
+    if (g_verbose) {
+      logVerbose("  [SKIP] " + backoff);
+    }
+    return status;
+  }
+  GitFailure fetchFailure = GitFailure::None;
+  auto fetchStarted = std::chrono::steady_clock::now();
+  bool fetched =
+      fetchUpdates(repoPath, &status.lockContention, &fetchFailure);
+  if (fetched) {
+    recordPhase(repoPath, PHASE_FETCH,
+                std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - fetchStarted)
+                    .count());
+  }
+  if (g_daemon) {
+    recordFetchOutcome(repoPath, fetchFailure);
+  }
+  if (g_progress && fetched) {
+    g_progress->fetched++;
+  }
+  status.hadUncommittedChanges =
+      uncommittedProbe.valid() && uncommittedProbe.get();
+  if (status.hadUncommittedChanges && g_verbose) {
+    logVerbose("  [WARNING] Repository has uncommitted changes!");
+  }
+
+  // Verify after the fetch so the packs it brought in are covered too, and
+  // never pull into a damaged repository. A failed fetch is often the first
+  // symptom of corruption, so that case is verified as well.
+  if (g_verify && !status.lockContention) {
+    if (g_verbose) {
+      logVerbose("  [STEP] Verifying new objects...");
+    }
+    std::string problem;
+    if (!verifyNewObjects(repoPath, problem)) {
+      status.corrupted = true;
+      status.error = "Corrupt: " + problem;
+      if (g_verbose) {
+        logVerbose("  [ERROR] " + status.error);
+      }
+      return status;
+    }
+  }
+
+  if (!fetched) {
+    status.fetchFailure = fetchFailure;
+    status.error = status.lockContention
+                       ? "Locked by another git process"
+                       : "Fetch failed: " + describeFailure(fetchFailure);
+    if (g_verbose) {
+      logVerbose("  [ERROR] " + status.error);
+    }
+    return status;
+  }
+
+  // Check if behind
+  if (g_verbose) {
+    logVerbose("  [STEP] Checking commits behind remote...");
+  }
+  status.upstreamOid =
+      resolveRefOid(repoPath, "refs/remotes/origin/" + status.currentBranch);
+  int cachedBehind = lookupBehindCache(repoPath, status.headOid,
+                                       status.upstreamOid);
+  if (cachedBehind >= 0) {
+    status.behindBy = cachedBehind;
+    status.behindCached = true;
+    if (g_verbose) {
+      logVerbose("  [CACHE] HEAD and upstream unchanged, reusing behind count");
+    }
+  } else {
+    status.behindBy = checkBehindCommits(repoPath, status.currentBranch);
+    storeBehindCache(repoPath, status.headOid, status.upstreamOid,
+                     status.behindBy);
+  }
+
+  if (g_adaptive) {
+    if (g_verbose) {
+      logVerbose("  [STEP] Learning upstream commit rate...");
+    }
+    status.commitsPerDay = learnCommitRate(repoPath, status.currentBranch);
+  }
+
+  if (status.behindBy > 0) {
+    status.hasUpdates = true;
+    if (g_verbose) {
+      logVerbose("  [RESULT] Behind by " + std::to_string(status.behindBy) +
+                 " commit(s)");
+    }
+
+    if (g_plan && !status.headOid.empty() && !status.upstreamOid.empty()) {
+      status.incomingFiles =
+          countChangedFiles(repoPath, status.headOid, status.upstreamOid);
+    }
+
+    if (g_needStaleness && !status.headOid.empty() &&
+        !status.upstreamOid.empty()) {
+      if (g_verbose) {
+        logVerbose("  [STEP] Measuring how old the missing commits are...");
+      }
+      measureStaleness(repoPath, status);
+    }
+
+    // Collect the changelog before pulling, as HEAD..origin is empty after
+    if (g_changelogLimit > 0) {
+      if (g_verbose) {
+        logVerbose("  [STEP] Reading incoming commits...");
+      }
+      status.changelog =
+          getIncomingCommits(repoPath, status.currentBranch, g_changelogLimit,
+                             status.changelogTotal);
+    }
+
+    // Don't pull updates whose manifest needs a newer MediaWiki than the
+    // one installed: that would only break the wiki until rolled back
+    if (g_compatCheck && !g_coreVersion.empty() &&
+        (type == "extension" || type == "skin")) {
+      std::string manifest =
+          readUpstreamManifest(repoPath, status.currentBranch, type);
+      if (scanManifest(manifest, status.upstreamVersion,
+                       status.requiresMediaWiki) &&
+          !status.requiresMediaWiki.empty() &&
+          !versionSatisfies(g_coreVersion, status.requiresMediaWiki)) {
+        status.incompatible = true;
+        if (g_verbose) {
+          logVerbose("  [WARNING] Upstream " +
+                     (status.upstreamVersion.empty()
+                          ? std::string("revision")
+                          : status.upstreamVersion) +
+                     " requires MediaWiki " +
+                     status.requiresMediaWiki + ", installed is " +
+                     g_coreVersion);
+        }
+      }
+    }
+
+    // Perform git pull if conditions are met
     // Skip auto-pull in update mode (updateSingleRepo handles it)
     bool shouldPull =
-        !g_reportOnly && !g_updateMode &&
+        !g_reportOnly && !g_updateMode && !status.incompatible &&
         (status.currentBranch == "master" || status.currentBranch == "main");
 
-    if (shouldPull) {
-      // Prompt for confirmation unless --yes was passed
-      bool userConfirmed = g_autoYes;
-      if (!g_autoYes) {
-        std::ostringstream prompt;
-        prompt << "\nPull updates for '" << status.name << "' (" << status.type
-               << ", " << status.behindBy << " commit"
-               << (status.behindBy > 1 ? "s" : "") << " behind)";
-        if (status.hadUncommittedChanges) {
-          prompt << "\n  ⚠️  WARNING: Has uncommitted changes!";
-        }
-        prompt << "\n  ";
-        userConfirmed = promptForConfirmation(prompt.str());
+    if (shouldPull) {
+      // Prompt for confirmation unless --yes was passed
+      bool userConfirmed = g_autoYes;
+      if (!g_autoYes) {
+        std::ostringstream prompt;
+        prompt << "\nPull updates for '" << status.name << "' (" << status.type
+               << ", " << status.behindBy << " commit"
+               << (status.behindBy > 1 ? "s" : "") << " behind)";
+        if (status.hadUncommittedChanges) {
+          prompt << "\n  ⚠️  WARNING: Has uncommitted changes!";
+        }
+        prompt << "\n  ";
+        userConfirmed = promptForConfirmation(prompt.str());
+      }
+
+      if (userConfirmed) {
+        if (g_verbose) {
+          logVerbose("  [STEP] Performing git pull...");
+        }
+        auto pullStarted = std::chrono::steady_clock::now();
+        if (performGitPull(repoPath, status.pullError, &status.lockContention,
+                           updateStrategyFor(type, status.name))) {
+          status.pulled = true;
+          status.pulledOid = resolveRefOid(repoPath, "HEAD");
+          // Large fast-forwards time themselves, separately
+          int files =
+              countChangedFiles(repoPath, status.headOid, status.pulledOid);
+          if (files < LARGE_FASTFORWARD_FILES) {
+            recordPhase(repoPath, PHASE_UPDATE,
+                        std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - pullStarted)
+                            .count());
+            recordPhase(repoPath, PHASE_UPDATE_FILES, files);
+          }
+          if (g_progress) {
+            g_progress->pulled++;
+          }
+          if (g_verbose) {
+            logVerbose("  [SUCCESS] Git pull completed");
+          }
+        } else {
+          if (g_verbose) {
+            logVerbose("  [ERROR] Git pull failed: " + status.pullError);
+          }
+        }
+      } else {
+        if (g_verbose) {
+          logVerbose("  [INFO] User declined pull");
+        }
+        // Keep hasUpdates true but don't pull
+      }
+    }
+  } else if (status.behindBy < 0) {
+    status.error = "No tracking branch or error checking";
+    if (g_verbose) {
+      logVerbose("  [WARNING] No tracking branch or error checking");
+    }
+  } else {
+    if (g_verbose) {
+      logVerbose("  [RESULT] Up to date");
+    }
+  }
+
+  return status;
+}
+
+struct Statistics {
+  int upToDate = 0;
+  int hasUpdates = 0;
+  int errors = 0;
+  int locked = 0;
+  int corrupted = 0;
+};
+
+/**
+ * Calculate statistics from repository statuses
+ *
+ * @param results The vector of repository statuses
+ * @return The calculated statistics
+ */
+Statistics calculateStats(const std::vector<RepoStatus> &results) {
+  Statistics stats;
+  for (const auto &status : results) {
+    if (status.corrupted) {
+      stats.corrupted++;
+    }
+    if (status.lockContention) {
+      stats.locked++;
+    } else if (!status.isRepo || !status.error.empty()) {
+      stats.errors++;
+    } else if (status.hasUpdates) {
+      stats.hasUpdates++;
+    } else {
+      stats.upToDate++;
+    }
+  }
+  return stats;
+}
+
+/**
+ * Print verbose directory header
+ *
+ * @param dirType The type of directory (extensions, skins)
+ * @param dirPath The directory path
+ */
+void printVerboseDirectoryHeader(const std::string &dirType,
+                                 const fs::path &dirPath) {
+  if (!g_verbose)
+    return;
+  std::cout << "\n" << std::string(80, '=') << "\n";
+  std::cout << "Scanning " << dirType << " directory: " << dirPath.string()
+            << "\n";
+  std::cout << std::string(80, '=') << "\n";
+}
+
+/**
+ * List the immediate subdirectories of a directory as repository targets
+ *
+ * @param dirPath The directory path to scan
+ * @param type The type of repositories (extension, skin)
+ * @return A vector of repository targets
+ */
+std::vector<RepoTarget> listDirectoryTargets(const fs::path &dirPath,
+                                             const std::string &type) {
+  std::vector<RepoTarget> targets;
+
+  if (!fs::exists(dirPath) || !fs::is_directory(dirPath)) {
+    return targets;
+  }
+
+  for (const auto &entry : fs::directory_iterator(dirPath)) {
+    if (entry.is_directory()) {
+      targets.push_back({entry.path(), type, ""});
+    }
+  }
+  return targets;
+}
+
+/**
+ * Recursively discover git repositories below a root directory
+ *
+ * Dependency and VCS metadata trees (node_modules, .git, ...) are pruned, and
+ * symlinks are not followed. Repositories inside other repositories are found
+ * too, since discovery keeps descending after a match.
+ *
+ * @param root The directory to search
+ * @param basePath The MediaWiki installation path, used for display names
+ * @param type The type label to give discovered repositories
+ * @param skipTopLevel Skip repositories directly below the root (they are
+ * already checked as extensions or skins)
+ * @return A vector of repository targets
+ */
+std::vector<RepoTarget> discoverNestedRepos(const fs::path &root,
+                                            const fs::path &basePath,
+                                            const std::string &type,
+                                            bool skipTopLevel) {
+  std::vector<RepoTarget> targets;
+  std::error_code ec;
+  if (!fs::is_directory(root, ec)) {
+    return targets;
+  }
+
+  // A root that is itself a repository (such as vendor/) counts too
+  if (!skipTopLevel && fs::exists(root / ".git", ec)) {
+    targets.push_back(
+        {root, type, fs::relative(root, basePath, ec).generic_string()});
+  }
+
+  fs::recursive_directory_iterator it(
+      root, fs::directory_options::skip_permission_denied, ec);
+  for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+    const fs::directory_entry &entry = *it;
+    if (!entry.is_directory(ec) || entry.is_symlink(ec)) {
+      continue;
+    }
+
+    std::string dirName = entry.path().filename().string();
+    if (std::find(DISCOVERY_PRUNED_DIRS.begin(), DISCOVERY_PRUNED_DIRS.end(),
+                  dirName) != DISCOVERY_PRUNED_DIRS.end()) {
+      it.disable_recursion_pending();
+      continue;
+    }
+    if (it.depth() + 1 >= DISCOVERY_MAX_DEPTH) {
+      it.disable_recursion_pending();
+    }
+
+    if (skipTopLevel && it.depth() == 0) {
+      continue;
+    }
+    if (fs::exists(entry.path() / ".git", ec)) {
+      targets.push_back(
+          {entry.path(), type,
+           fs::relative(entry.path(), basePath, ec).generic_string()});
+    }
+  }
+
+  std::sort(targets.begin(), targets.end(),
+            [](const RepoTarget &a, const RepoTarget &b) {
+              return a.path < b.path;
+            });
+  return targets;
+}
+
+/**
+ * Run a task for every index in [0, count) on a pool of worker threads
+ *
+ * Workers take the next index as soon as they finish one, so a slow item
+ * never holds up a batch of others.
+ *
+ * @param count The number of items
+ * @param task The task to run for each item index
+ */
+void runInParallel(size_t count, const std::function<void(size_t)> &task) {
+  if (count == 0) {
+    return;
+  }
+  const unsigned int maxThreads =
+      std::max(1u, std::thread::hardware_concurrency());
+  const size_t workerCount = std::min(static_cast<size_t>(maxThreads), count);
+  std::atomic<size_t> nextIndex{0};
+
+  auto worker = [&]() {
+    for (size_t i = nextIndex++; i < count; i = nextIndex++) {
+      task(i);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  workers.reserve(workerCount);
+  for (size_t i = 0; i < workerCount; i++) {
+    workers.emplace_back(worker);
+  }
+  for (auto &thread : workers) {
+    thread.join();
+  }
+}
+
+/**
+ * Get the expected check duration of each repository from the timings
+ * saved by earlier runs
+ *
+ * @param targets The repositories about to be checked
+ * @return Expected seconds per target, 0 where nothing is known
+ */
+std::vector<double> expectedCheckSeconds(
+    const std::vector<RepoTarget> &targets) {
+  std::vector<double> expected(targets.size(), 0);
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  StateTable &timings = stateTable("timings");
+  for (size_t i = 0; i < targets.size(); i++) {
+    auto it = timings.find(stateKey(targets[i].path));
+    if (it != timings.end() && !it->second.empty()) {
+      expected[i] = std::atof(it->second[0].c_str());
+    }
+  }
+  return expected;
+}
+
+/**
+ * Remember how long a repository took to check, smoothed with earlier runs
+ *
+ * @param repoPath The repository path
+ * @param seconds The duration of this check
+ */
+void recordCheckSeconds(const fs::path &repoPath, double seconds) {
+  std::lock_guard<std::mutex> lock(g_stateMutex);
+  std::vector<std::string> &entry = stateTable("timings")[stateKey(repoPath)];
+  if (!entry.empty()) {
+    seconds = 0.5 * seconds + 0.5 * std::atof(entry[0].c_str());
+  }
+  std::ostringstream oss;
+  oss << std::fixed << std::setprecision(3) << seconds;
+  entry = {oss.str()};
+}
+
+/**
+ * Describe the current progress in one line
+ *
+ * @param progress The progress state
+ * @param barWidth Width of the progress bar, or 0 for none
+ * @return The progress line, without a newline
+ */
+std::string describeProgress(const ProgressState &progress, int barWidth) {
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - progress.startTime)
+                       .count();
+  size_t finished = progress.finished;
+
+  // Repositories without history are assumed to take as long as the
+  // average of those finished so far (or of the history when none are)
+  double knownSum = 0;
+  size_t knownCount = 0;
+  for (double seconds : progress.expectedSeconds) {
+    if (seconds > 0) {
+      knownSum += seconds;
+      knownCount++;
+    }
+  }
+  double fallback = finished > 0 ? elapsed * progress.workers / finished
+                    : knownCount > 0 ? knownSum / knownCount
+                                     : 0;
+  double remaining = 0;
+  for (size_t i = 0; i < progress.total; i++) {
+    long long startedAt = progress.startedAtMs[i];
+    if (startedAt < 0) {
+      continue;
+    }
+    double expected = progress.expectedSeconds[i] > 0
+                          ? progress.expectedSeconds[i]
+                          : fallback;
+    if (startedAt > 0) {
+      expected = std::max(0.0, expected - (elapsed - startedAt / 1000.0));
+    }
+    remaining += expected;
+  }
+
+  std::ostringstream oss;
+  if (barWidth > 0) {
+    int filled = progress.total > 0
+                     ? static_cast<int>(barWidth * finished / progress.total)
+                     : barWidth;
+    oss << "[" << std::string(filled, '#')
+        << std::string(barWidth - filled, '-') << "] ";
+  }
+  oss << finished << "/" << progress.total << " checked, "
+      << progress.fetched << " fetched, " << progress.pulled << " pulled, "
+      << progress.running << " running";
+  if (elapsed > 0 && finished > 0) {
+    oss << ", " << std::fixed << std::setprecision(1) << finished / elapsed
+        << "/s";
+  }
+  if (fallback > 0) {
+    oss << ", ETA "
+        << formatDuration(static_cast<long long>(
+               std::ceil(remaining / std::max<size_t>(1, progress.workers))));
+  }
+  return oss.str();
+}
+
+/**
+ * Draw the progress display until told to stop: a bar redrawn a few times
+ * per second on a terminal, otherwise a summary line every 30 seconds
+ *
+ * @param progress The progress state
+ * @param stopMutex Guards stop
+ * @param stopSignal Notified when stop is set
+ * @param stop Set when checking is done
+ */
+void renderProgress(const ProgressState &progress, std::mutex &stopMutex,
+                    std::condition_variable &stopSignal, const bool &stop) {
+  const bool tty = isatty(STDOUT_FILENO);
+  const auto interval =
+      tty ? std::chrono::milliseconds(250) : std::chrono::milliseconds(30000);
+  bool drawn = false;
+  std::unique_lock<std::mutex> lock(stopMutex);
+  while (!stopSignal.wait_for(lock, interval, [&stop] { return stop; })) {
+    std::string line = describeProgress(progress, tty ? 20 : 0);
+    std::lock_guard<std::mutex> coutLock(g_coutMutex);
+    if (tty) {
+      std::cout << "\r\033[K" << line << std::flush;
+      drawn = true;
+    } else {
+      std::cout << "Progress: " << line << std::endl;
+    }
+  }
+  if (drawn) {
+    std::lock_guard<std::mutex> coutLock(g_coutMutex);
+    std::cout << "\r\033[K" << std::flush;
+  }
+}
+
+/**
+ * Check a list of repositories on a shared pool of worker threads
+ *
+ * All repositories of a run go through this one scheduler.
+ *
+ * @param targets The repositories to check
+ * @param onResult Optional callback invoked from the worker thread as each
+ * repository finishes, with its index in targets
+ * @return The repository statuses, in the same order as the targets
+ */
+std::vector<RepoStatus> checkRepositories(
+    const std::vector<RepoTarget> &targets,
+    const std::function<void(size_t, const RepoStatus &)> &onResult =
+        nullptr) {
+  pruneNegativeCache();
+  ProgressState progress;
+  progress.total = targets.size();
+  progress.workers = std::min<size_t>(
+      std::max(1u, std::thread::hardware_concurrency()), targets.size());
+  progress.startTime = std::chrono::steady_clock::now();
+  progress.startedAtMs = std::vector<std::atomic<long long>>(targets.size());
+  progress.expectedSeconds = expectedCheckSeconds(targets);
+
+  // Verbose logging and the daemon's log would be garbled by the display
+  bool showProgress = g_progressDisplay && !g_verbose && !g_daemon;
+  std::mutex stopMutex;
+  std::condition_variable stopSignal;
+  bool stop = false;
+  std::thread renderer;
+  if (showProgress) {
+    g_progress = &progress;
+    renderer = std::thread(renderProgress, std::cref(progress),
+                           std::ref(stopMutex), std::ref(stopSignal),
+                           std::cref(stop));
+  }
+
+  std::vector<RepoStatus> results(targets.size());
+  runInParallel(targets.size(), [&](size_t i) {
+    auto started = std::chrono::steady_clock::now();
+    // Clamp to 1ms so a start in the first millisecond is not "not started"
+    progress.startedAtMs[i] = std::max<long long>(
+        1, std::chrono::duration_cast<std::chrono::milliseconds>(
+               started - progress.startTime)
+               .count());
+    progress.running++;
+    results[i] = checkRepository(targets[i].path, targets[i].type);
+    if (!targets[i].name.empty()) {
+      results[i].name = targets[i].name;
+    }
+    recordCheckSeconds(targets[i].path,
+                       std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - started)
+                           .count());
+    progress.startedAtMs[i] = -1;
+    progress.running--;
+    progress.finished++;
+    if (onResult) {
+      onResult(i, results[i]);
+    }
+  });
+
+  if (showProgress) {
+    {
+      std::lock_guard<std::mutex> lock(stopMutex);
+      stop = true;
+    }
+    stopSignal.notify_one();
+    renderer.join();
+    g_progress = nullptr;
+  }
+
+  // Repositories that stayed locked go to the back of the queue: by now
+  // whatever held the lock has had the whole run to finish
+  std::vector<size_t> requeued;
+  for (size_t i = 0; i < results.size(); i++) {
+    if (results[i].lockContention) {
+      requeued.push_back(i);
+    }
+  }
+  runInParallel(requeued.size(), [&](size_t j) {
+    size_t i = requeued[j];
+    if (g_verbose) {
+      logVerbose("  [REQUEUE] " + results[i].name + " was locked, retrying");
+    }
+    std::string name = results[i].name;
+    results[i] = checkRepository(targets[i].path, targets[i].type);
+    results[i].name = name;
+    if (onResult) {
+      onResult(i, results[i]);
+    }
+  });
+
+  saveStateTables();
+  return results;
+}
+
+/**
+ * Select the results of the given repository types
+ *
+ * @param results The vector of repository statuses
+ * @param types The repository types to keep
+ * @return The matching repository statuses
+ */
+std::vector<RepoStatus> filterByType(const std::vector<RepoStatus> &results,
+                                     const std::vector<std::string> &types) {
+  std::vector<RepoStatus> filtered;
+  for (const auto &status : results) {
+    if (std::find(types.begin(), types.end(), status.type) != types.end()) {
+      filtered.push_back(status);
+    }
+  }
+  return filtered;
+}
+
+/**
+ * Collect every repository of a MediaWiki installation: core, extensions,
+ * skins and (with --nested) nested repositories
+ *
+ * @param basePath The MediaWiki installation path
+ * @param announce Print a progress line per repository group
+ * @return A vector of repository targets, core first
+ */
+std::vector<RepoTarget> collectTargets(const fs::path &basePath,
+                                       bool announce) {
+  std::vector<RepoTarget> targets;
+  targets.push_back({basePath, "core", ""});
+  if (announce) {
+    std::cout << "Checking MediaWiki core...\n";
+  }
+
+  fs::path extensionsPath = basePath / "extensions";
+  if (announce) {
+    printVerboseDirectoryHeader("extensions", extensionsPath);
+  }
+  std::vector<RepoTarget> extensionTargets =
+      listDirectoryTargets(extensionsPath, "extension");
+  if (announce) {
+    std::cout << "Checking extensions (" << extensionTargets.size()
+              << ")...\n";
+  }
+  targets.insert(targets.end(), extensionTargets.begin(),
+                 extensionTargets.end());
+
+  fs::path skinsPath = basePath / "skins";
+  if (announce) {
+    printVerboseDirectoryHeader("skins", skinsPath);
+  }
+  std::vector<RepoTarget> skinTargets = listDirectoryTargets(skinsPath, "skin");
+  if (announce) {
+    std::cout << "Checking skins (" << skinTargets.size() << ")...\n";
+  }
+  targets.insert(targets.end(), skinTargets.begin(), skinTargets.end());
+
+  if (g_nested) {
+    std::vector<RepoTarget> nestedTargets =
+        discoverNestedRepos(basePath / "vendor", basePath, "vendor", false);
+    for (const auto &dir : {extensionsPath, skinsPath}) {
+      std::vector<RepoTarget> found =
+          discoverNestedRepos(dir, basePath, "nested", true);
+      nestedTargets.insert(nestedTargets.end(), found.begin(), found.end());
+    }
+    for (const auto &root : g_scanRoots) {
+      std::vector<RepoTarget> found =
+          discoverNestedRepos(basePath / root, basePath, "nested", false);
+      nestedTargets.insert(nestedTargets.end(), found.begin(), found.end());
+    }
+    if (announce) {
+      std::cout << "Checking nested repositories (" << nestedTargets.size()
+                << ")...\n";
+    }
+    targets.insert(targets.end(), nestedTargets.begin(), nestedTargets.end());
+  }
+
+  return targets;
+}
+
+/**
+ * Describe a repository status in a few words for log lines
+ *
+ * @param status The repository status
+ * @return A short description
+ */
+std::string describeStatus(const RepoStatus &status) {
+  std::string cached = status.negativeCached ? " (cached)" : "";
+  if (!status.isRepo) {
+    return "not a git repo" + cached;
+  }
+  if (!status.error.empty()) {
+    return status.error + cached;
+  }
+  if (status.pulled) {
+    return "pulled";
+  }
+  if (!status.pullError.empty()) {
+    return "pull failed";
+  }
+  if (status.hasUpdates) {
+    return std::to_string(status.behindBy) + " commit" +
+           (status.behindBy > 1 ? "s" : "") + " behind";
+  }
+  return "up to date";
+}
+
+/**
+ * Print repository statuses with only the columns chosen by --columns
+ *
+ * @param results The vector of repository statuses
+ * @param reportStream Optional output file stream for the report
+ */
+void printColumns(const std::vector<RepoStatus> &results,
+                  std::ofstream *reportStream = nullptr) {
+  const std::map<std::string, std::pair<std::string, int>> headers = {
+      {"name", {"Name", 30}},     {"type", {"Type", 12}},
+      {"branch", {"Branch", 15}}, {"behind", {"Behind", 10}},
+      {"dirty", {"Uncommitted", 14}}, {"stale", {"Oldest missing", 16}},
+      {"status", {"Status", 0}}};
+
+  std::ostringstream oss;
+  oss << "\n" << std::string(100, '=') << "\n" << std::left;
+  // The last column is not padded
+  auto width = [&](size_t i) {
+    return i + 1 < g_columns.size() ? headers.at(g_columns[i]).second : 0;
+  };
+  for (size_t i = 0; i < g_columns.size(); i++) {
+    oss << std::setw(width(i)) << headers.at(g_columns[i]).first;
+  }
+  oss << "\n" << std::string(100, '-') << "\n";
+
+  for (const auto &status : results) {
+    for (size_t i = 0; i < g_columns.size(); i++) {
+      const std::string &column = g_columns[i];
+      std::string value;
+      if (column == "name") {
+        value = status.name;
+      } else if (column == "type") {
+        value = status.type;
+      } else if (column == "branch") {
+        value = status.currentBranch.empty() ? "N/A" : status.currentBranch;
+      } else if (column == "behind") {
+        value = status.isRepo && status.error.empty()
+                    ? std::to_string(status.behindBy)
+                    : "N/A";
+      } else if (column == "dirty") {
+        value = !status.isRepo ? "N/A"
+                : status.hadUncommittedChanges ? "Yes"
+                                               : "No";
+      } else if (column == "stale") {
+        value = status.oldestMissingTime && !status.pulled
+                    ? formatDuration(std::time(nullptr) -
+                                     status.oldestMissingTime)
+                    : "-";
+      } else if (column == "status") {
+        value = describeStatus(status);
+      }
+      oss << std::setw(width(i)) << value;
+    }
+    oss << "\n";
+  }
+
+  oss << std::string(100, '=') << "\n";
+  writeOutput(oss.str(), reportStream);
+}
+
+/**
+ * Print results in a formatted table
+ *
+ * @param results The vector of repository statuses
+ * @param reportStream Optional output file stream for the report
+ */
+void printResults(const std::vector<RepoStatus> &results,
+                  std::ofstream *reportStream = nullptr) {
+  if (results.empty()) {
+    return;
+  }
+  if (!g_columns.empty()) {
+    printColumns(results, reportStream);
+    return;
+  }
+
+  std::ostringstream oss;
+  oss << "\n" << std::string(100, '=') << "\n";
+  oss << std::left << std::setw(30) << "Name" << std::setw(12) << "Type"
+      << std::setw(15) << "Branch" << std::setw(10) << "Behind" << std::setw(14)
+      << "Uncommitted"
+      << "Status\n";
+  oss << std::string(100, '-') << "\n";
+
+  for (const auto &status : results) {
+    oss << std::left << std::setw(30) << status.name << std::setw(12)
+        << status.type << std::setw(15)
+        << (status.currentBranch.empty() ? "N/A" : status.currentBranch);
+
+    if (!status.isRepo) {
+      oss << std::setw(10) << "N/A" << std::setw(14) << "N/A"
+          << "⚠️  Not a git repo"
+          << (status.negativeCached ? " (cached)" : "") << "\n";
+    } else if (status.lockContention && !status.error.empty()) {
+      oss << std::setw(10) << "N/A" << std::setw(14) << "N/A"
+          << "🔒 " << status.error << "\n";
+    } else if (status.lockContention) {
+      oss << std::setw(10) << status.behindBy << std::setw(14)
+          << (status.hadUncommittedChanges ? "Yes" : "No")
+          << "🔒 Pull blocked: locked by another git process\n";
+    } else if (status.corrupted) {
+      oss << std::setw(10) << "N/A" << std::setw(14)
+          << (status.hadUncommittedChanges ? "Yes" : "No") << "💥 "
+          << status.error << "\n";
+    } else if (!status.error.empty()) {
+      oss << std::setw(10) << "N/A" << std::setw(14) << "N/A"
+          << "⚠️  " << status.error
+          << (status.negativeCached ? " (cached)" : "") << "\n";
+    } else if (!g_needFetch) {
+      oss << std::setw(10) << "-" << std::setw(14)
+          << (status.hadUncommittedChanges ? "Yes" : "No")
+          << "Not fetched\n";
+    } else if (status.pulled) {
+      oss << std::setw(10) << "0" << std::setw(14)
+          << (status.hadUncommittedChanges ? "Yes" : "No");
+      if (status.hadUncommittedChanges) {
+        oss << "✅ Pulled (⚠️  had uncommitted changes)\n";
+      } else {
+        oss << "✅ Pulled and up to date\n";
+      }
+    } else if (!status.pullError.empty()) {
+      oss << std::setw(10) << status.behindBy << std::setw(14)
+          << (status.hadUncommittedChanges ? "Yes" : "No")
+          << "❌ Pull failed: " << status.pullError << "\n";
+    } else if (status.incompatible) {
+      oss << std::setw(10) << status.behindBy << std::setw(14)
+          << (status.hadUncommittedChanges ? "Yes" : "No")
+          << "⛔ Needs MediaWiki " << status.requiresMediaWiki << " (have "
+          << g_coreVersion << ")\n";
+    } else if (status.hasUpdates) {
+      oss << std::setw(10) << status.behindBy << std::setw(14)
+          << (status.hadUncommittedChanges ? "Yes" : "No")
+          << "🔴 Updates available\n";
+    } else {
+      oss << std::setw(10) << "0" << std::setw(14)
+          << (status.hadUncommittedChanges ? "Yes" : "No") << "✅ Up to date\n";
+    }
+  }
+
+  oss << std::string(100, '=') << "\n";
+  writeOutput(oss.str(), reportStream);
+}
+
+/**
+ * Print results section with fallback message
+ *
+ * @param title The section title
+ * @param results The vector of repository statuses
+ * @param reportStream Optional output file stream for the report
+ */
+void printResultsSection(const std::string &title,
+                         const std::vector<RepoStatus> &results,
+                         std::ofstream *reportStream = nullptr) {
+  std::ostringstream oss;
+  oss << "\n" << title << ":\n";
+  writeOutput(oss.str(), reportStream);
+
+  if (!results.empty()) {
+    printResults(results, reportStream);
+  } else {
+    std::ostringstream msg;
+    if (!g_onlyFilter.empty()) {
+      msg << "No matching repositories.\n";
+    } else if (title == "EXTENSIONS") {
+      msg << "No extensions found or extensions directory doesn't exist.\n";
+    } else if (title == "SKINS") {
+      msg << "No skins found or skins directory doesn't exist.\n";
+    } else if (title == "NESTED REPOSITORIES") {
+      msg << "No nested repositories found.\n";
+    }
+    writeOutput(msg.str(), reportStream);
+  }
+}
+
+/**
+ * Print the incoming commits of every repository that had updates
+ *
+ * @param results The vector of repository statuses
+ * @param reportStream Optional output file stream for the report
+ */
+void printChangelog(const std::vector<RepoStatus> &results,
+                    std::ofstream *reportStream = nullptr) {
+  std::ostringstream oss;
+  for (const auto &status : results) {
+    if (!status.hasUpdates || status.changelog.empty()) {
+      continue;
+    }
+    oss << "\n" << status.name << " (" << status.type << ", "
+        << status.behindBy << " commit" << (status.behindBy > 1 ? "s" : "")
+        << " behind):\n";
+    for (const auto &line : status.changelog) {
+      std::istringstream fields(line);
+      std::string hash, author, subject;
+      std::getline(fields, hash, '\t');
+      std::getline(fields, author, '\t');
+      std::getline(fields, subject);
+      oss << "  " << hash << "  " << subject << " (" << author << ")\n";
+    }
+    // Merges are left out of the list, so they are left out of the count
+    int shown = static_cast<int>(status.changelog.size());
+    if (status.changelogTotal > shown) {
+      oss << "  ... and " << (status.changelogTotal - shown) << " more\n";
+    }
+  }
+  if (oss.tellp() > 0) {
+    writeOutput("\nCHANGELOG:\n" + oss.str(), reportStream);
+  }
+}
+
+/**
+ * Seconds since the oldest upstream commit a repository is still missing
+ * was committed
+ *
+ * @param status The repository status
+ * @param now The current Unix time
+ * @return The staleness, or 0 if the repository is not behind
+ */
+long long stalenessSeconds(const RepoStatus &status, long long now) {
+  if (!status.hasUpdates || status.pulled || !status.oldestMissingTime) {
+    return 0;
+  }
+  return std::max(0LL, now - status.oldestMissingTime);
+}
+
+/**
+ * Print the repositories still behind their upstream, stalest first: the
+ * age of the oldest commit not yet pulled, and of HEAD
+ *
+ * @param results The vector of repository statuses
+ * @param reportStream Optional output file stream for the report
+ */
+void printStaleness(const std::vector<RepoStatus> &results,
+                    std::ofstream *reportStream = nullptr) {
+  long long now = static_cast<long long>(std::time(nullptr));
+  std::vector<const RepoStatus *> stale;
+  for (const auto &status : results) {
+    if (status.hasUpdates && !status.pulled && status.oldestMissingTime) {
+      stale.push_back(&status);
+    }
+  }
+  if (stale.empty()) {
+    return;
+  }
+  std::stable_sort(stale.begin(), stale.end(),
+                   [now](const RepoStatus *a, const RepoStatus *b) {
+                     return stalenessSeconds(*a, now) >
+                            stalenessSeconds(*b, now);
+                   });
+
+  std::ostringstream oss;
+  oss << "\nSTALENESS:\n";
+  oss << "\n" << std::string(86, '=') << "\n";
+  oss << std::left << std::setw(30) << "Name" << std::setw(12) << "Type"
+      << std::setw(10) << "Behind" << std::setw(18) << "Oldest missing"
+      << "HEAD age\n";
+  oss << std::string(86, '-') << "\n";
+  for (const RepoStatus *status : stale) {
+    oss << std::left << std::setw(30) << status->name << std::setw(12)
+        << status->type << std::setw(10) << status->behindBy << std::setw(18)
+        << formatDuration(stalenessSeconds(*status, now))
+        << (status->headCommitTime
+                ? formatDuration(std::max(0LL, now - status->headCommitTime))
+                : std::string("unknown"))
+        << "\n";
+  }
+  oss << std::string(86, '=') << "\n";
+  writeOutput(oss.str(), reportStream);
+}
+
+/**
+ * Write per-repository gauges in the Prometheus text format, stalest
+ * repository first, replacing the file atomically so a collector never
+ * reads half of it
+ *
+ * @param path The metrics file
+ * @param results The vector of repository statuses
+ * @return true on success
+ */
+bool writeMetricsFile(const std::string &path,
+                      const std::vector<RepoStatus> &results) {
+  long long now = static_cast<long long>(std::time(nullptr));
+  std::vector<const RepoStatus *> ranked;
+  for (const auto &status : results) {
+    if (status.isRepo && status.error.empty()) {
+      ranked.push_back(&status);
+    }
+  }
+  std::stable_sort(ranked.begin(), ranked.end(),
+                   [now](const RepoStatus *a, const RepoStatus *b) {
+                     return stalenessSeconds(*a, now) >
+                            stalenessSeconds(*b, now);
+                   });
+
+  auto escape = [](const std::string &value) {
+    std::string escaped;
+    for (char c : value) {
+      if (c == '\n') {
+        escaped += "\\n";
+        continue;
+      }
+      if (c == '\\' || c == '"') {
+        escaped += '\\';
+      }
+      escaped += c;
+    }
+    return escaped;
+  };
+  // Nested repositories can share a name, so the path keeps series apart
+  auto labels = [&escape](const RepoStatus &status) {
+    return "{repo=\"" + escape(status.name) + "\",type=\"" + status.type +
+           "\",path=\"" + escape(status.path.string()) + "\"}";
+  };
+  struct Gauge {
+    const char *name;
+    const char *help;
+    // Returns a negative value to leave the repository out
+    std::function<long long(const RepoStatus &)> value;
+  };
+  const std::vector<Gauge> gauges = {
+      {"local_mw_behind_commits", "Upstream commits not yet pulled",
+       [](const RepoStatus &status) {
+         return status.pulled ? 0LL : std::max(0, status.behindBy);
+       }},
+      {"local_mw_staleness_seconds",
+       "Age of the oldest upstream commit not yet pulled",
+       [now](const RepoStatus &status) {
+         return stalenessSeconds(status, now);
+       }},
+      {"local_mw_head_commit_timestamp_seconds",
+       "Committer time of HEAD before any pull, where it was read",
+       [](const RepoStatus &status) {
+         return status.headCommitTime ? status.headCommitTime : -1;
+       }},
+  };
+
+  fs::path temp = path + "." + std::to_string(getpid()) + ".tmp";
+  {
+    std::ofstream file(temp);
+    if (!file) {
+      return false;
+    }
+    for (const Gauge &gauge : gauges) {
+      file << "# HELP " << gauge.name << " " << gauge.help << "\n";
+      file << "# TYPE " << gauge.name << " gauge\n";
+      for (const RepoStatus *status : ranked) {
+        if (gauge.value(*status) < 0) {
+          continue;
+        }
+        file << gauge.name << labels(*status) << " " << gauge.value(*status)
+             << "\n";
+      }
+    }
+    if (!file) {
+      return false;
+    }
+  }
+  std::error_code ec;
+  fs::rename(temp, path, ec);
+  return !ec;
+}
+
+// Points each shard gets on the consistent hashing ring
+const int SHARD_VIRTUAL_NODES = 64;
+
+/**
+ * Mix bytes into a 64-bit FNV-1a hash
+ *
+ * @param hash The running hash
+ * @param data The bytes to mix in
+ */
+void fnv1aMix(uint64_t &hash, const std::string &data) {
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  // Separate fields so "ab"+"c" and "a"+"bc" hash differently
+  hash ^= 0xff;
+  hash *= 1099511628211ULL;
+}
+
+/**
+ * Assign repositories to shards by consistent hashing of their canonical
+ * paths, so adding a shard only moves about 1/N of the repositories (and
+ * their warm caches) to a different worker
+ *
+ * @param targets The repositories
+ * @param shardCount The number of shards
+ * @return The target indexes of each shard
+ */
+std::vector<std::vector<size_t>> assignShards(
+    const std::vector<RepoTarget> &targets, int shardCount) {
+  std::vector<std::pair<uint64_t, int>> ring;
+  for (int shard = 0; shard < shardCount; shard++) {
+    for (int node = 0; node < SHARD_VIRTUAL_NODES; node++) {
+      uint64_t hash = 14695981039346656037ULL;
+      fnv1aMix(hash, "shard-" + std::to_string(shard) + "-" +
+                         std::to_string(node));
+      ring.emplace_back(hash, shard);
+    }
+  }
+  std::sort(ring.begin(), ring.end());
+
+  std::vector<std::vector<size_t>> shards(shardCount);
+  for (size_t i = 0; i < targets.size(); i++) {
+    uint64_t hash = 14695981039346656037ULL;
+    fnv1aMix(hash, stateKey(targets[i].path));
+    auto it = std::lower_bound(ring.begin(), ring.end(),
+                               std::make_pair(hash, 0));
+    shards[it == ring.end() ? ring.front().second : it->second].push_back(i);
+  }
+  return shards;
+}
+
+// A repository's predicted share of an update run
+struct PlanStep {
+  const RepoStatus *status;
+  std::string actions;
+  double seconds = 0;
+  // Whether the checkout itself would be updated
+  bool updates = false;
+};
+
+/**
+ * Predict what updating a repository involves and how long it takes, from
+ * its recorded phase timings and the size of the incoming change
+ *
+ * @param status The repository status from a report-only check
+ * @param estimated Set when a default had to stand in for a timing
+ * @return The plan step
+ */
+PlanStep planRepository(const RepoStatus &status, bool &estimated) {
+  PlanStep step{&status, "fetch"};
+  double fetch = readPhase(status.path, PHASE_FETCH);
+  estimated = fetch < 0;
+  step.seconds = estimated ? DEFAULT_FETCH_SECONDS : fetch;
+  if (!status.hasUpdates) {
+    return step;
+  }
+  if (status.incompatible) {
+    step.actions += "; not updated (needs MediaWiki " +
+                    status.requiresMediaWiki + ")";
+    return step;
+  }
+  if (status.currentBranch != "master" && status.currentBranch != "main") {
+    step.actions += "; not updated (on branch " + status.currentBranch + ")";
+    return step;
+  }
+
+  int files = std::max(0, status.incomingFiles);
+  std::string strategy = updateStrategyFor(status.type, status.name);
+  bool large = strategy == "pull" && !status.hadUncommittedChanges &&
+               files >= LARGE_FASTFORWARD_FILES;
+  // Large fast-forwards have their own timings; until one has been timed,
+  // the normal path's are the best guess
+  double update = -1;
+  if (large) {
+    update = predictUpdateSeconds(status.path, PHASE_LARGE_UPDATE, files);
+  }
+  if (update < 0) {
+    update = predictUpdateSeconds(status.path, PHASE_UPDATE, files);
+  }
+  if (update < 0) {
+    estimated = true;
+    update = DEFAULT_UPDATE_SECONDS + DEFAULT_UPDATE_SECONDS_PER_FILE * files;
+  }
+  step.seconds += update;
+  step.updates = true;
+
+  std::string change = std::to_string(status.behindBy) + " commit" +
+                       (status.behindBy > 1 ? "s" : "") + ", " +
+                       std::to_string(files) + " file" +
+                       (files == 1 ? "" : "s");
+  if (strategy == "rebase") {
+    step.actions += "; rebase onto " + change;
+  } else if (large) {
+    step.actions += "; parallel fast-forward " + change;
+  } else {
+    step.actions += "; fast-forward " + change;
+  }
+  if (status.hadUncommittedChanges) {
+    step.actions += strategy == "pull" ? " (has local changes)"
+                                       : " (stashing local changes)";
+  }
+  return step;
+}
+
+/**
+ * Simulate the worker pool on a list of steps: like runInParallel(), each
+ * step goes to the first worker to become free, in order
+ *
+ * @param steps The steps, in the order they are queued
+ * @param workers The number of workers
+ * @param criticalPath Receives the steps run by the worker that finishes
+ * last, in order
+ * @return The predicted wall time of the steps
+ */
+double simulateWorkers(const std::vector<PlanStep> &steps, size_t workers,
+                       std::vector<const PlanStep *> &criticalPath) {
+  criticalPath.clear();
+  if (steps.empty()) {
+    return 0;
+  }
+  workers = std::max<size_t>(1, std::min(workers, steps.size()));
+  std::vector<double> freeAt(workers, 0);
+  std::vector<std::vector<const PlanStep *>> ran(workers);
+  for (const auto &step : steps) {
+    size_t worker =
+        std::min_element(freeAt.begin(), freeAt.end()) - freeAt.begin();
+    freeAt[worker] += step.seconds;
+    ran[worker].push_back(&step);
+  }
+  size_t last = std::max_element(freeAt.begin(), freeAt.end()) - freeAt.begin();
+  criticalPath = ran[last];
+  return freeAt[last];
+}
+
+/**
+ * Print what an update run would do to each repository with pending
+ * updates, its predicted cost, and the predicted wall time and critical
+ * path of the whole run under the worker pool (and --staged waves)
+ *
+ * @param basePath The MediaWiki installation path
+ * @param results The repository statuses from a report-only check, in
+ * target order
+ * @param reportStream Optional output file stream for the report
+ */
+void printPlan(const fs::path &basePath, const std::vector<RepoStatus> &results,
+               std::ofstream *reportStream = nullptr) {
+  std::vector<PlanStep> steps;
+  int estimated = 0;
+  for (const auto &status : results) {
+    if (!status.isRepo || !status.error.empty()) {
+      continue;
+    }
+    bool usedDefault = false;
+    steps.push_back(planRepository(status, usedDefault));
+    estimated += usedDefault ? 1 : 0;
+  }
+
+  std::ostringstream oss;
+  oss << "\nPLAN:\n";
+  oss << "\n" << std::string(100, '=') << "\n";
+  oss << std::left << std::setw(30) << "Name" << std::setw(12) << "Type"
+      << std::setw(12) << "Predicted"
+      << "Actions\n";
+  oss << std::string(100, '-') << "\n";
+  int fetchOnly = 0;
+  double fetchOnlySeconds = 0;
+  for (const auto &step : steps) {
+    if (!step.status->hasUpdates) {
+      fetchOnly++;
+      fetchOnlySeconds += step.seconds;
+      continue;
+    }
+    std::ostringstream seconds;
+    seconds << std::fixed << std::setprecision(1) << step.seconds << "s";
+    oss << std::left << std::setw(30) << step.status->name << std::setw(12)
+        << step.status->type << std::setw(12) << seconds.str() << step.actions
+        << "\n";
+  }
+  oss << std::string(100, '=') << "\n";
+  if (fetchOnly > 0) {
+    oss << "  Up to date (fetch only): " << fetchOnly << " repositor"
+        << (fetchOnly == 1 ? "y" : "ies") << ", " << std::fixed
+        << std::setprecision(1) << fetchOnlySeconds << "s in total\n";
+  }
+
+  // Stages run one after another: everything at once, or with --staged
+  // core alone and then each wave, each followed by the health check if
+  // it updates anything
+  std::vector<std::vector<PlanStep>> stages;
+  if (g_staged) {
+    std::vector<PlanStep> rest;
+    for (const auto &step : steps) {
+      if (step.status->type == "core") {
+        stages.push_back({step});
+      } else {
+        rest.push_back(step);
+      }
+    }
+    for (size_t start = 0; start < rest.size();
+         start += static_cast<size_t>(g_waveSize)) {
+      stages.emplace_back(
+          rest.begin() + start,
+          rest.begin() + std::min(rest.size(),
+                                  start + static_cast<size_t>(g_waveSize)));
+    }
+  } else {
+    stages.push_back(steps);
+  }
+  double health = readPhase(basePath, PHASE_HEALTH);
+  if (health < 0) {
+    health = DEFAULT_HEALTH_SECONDS;
+  }
+  // With --shards every shard is a process with a pool of its own, fed
+  // the repositories assignShards() gives it, like
+  // checkRepositoriesSharded(); a stage lasts as long as its slowest shard
+  const size_t workers = std::max(1u, std::thread::hardware_concurrency());
+  auto simulateStage = [&](const std::vector<PlanStep> &stage,
+                           std::vector<const PlanStep *> &critical) {
+    if (g_shards <= 1) {
+      return simulateWorkers(stage, workers, critical);
+    }
+    std::vector<RepoTarget> stageTargets;
+    for (const auto &step : stage) {
+      stageTargets.push_back({step.status->path, step.status->type, ""});
+    }
+    double slowest = 0;
+    critical.clear();
+    for (const auto &indexes : assignShards(stageTargets, g_shards)) {
+      std::vector<PlanStep> shardSteps;
+      for (size_t index : indexes) {
+        shardSteps.push_back(stage[index]);
+      }
+      std::vector<const PlanStep *> shardCritical;
+      double seconds = simulateWorkers(shardSteps, workers, shardCritical);
+      if (seconds > slowest) {
+        slowest = seconds;
+        // Point into the stage, not this shard's copy of it
+        critical.clear();
+        for (const PlanStep *step : shardCritical) {
+          critical.push_back(&stage[indexes[step - shardSteps.data()]]);
+        }
+      }
+    }
+    return slowest;
+  };
+  double total = 0;
+  std::vector<std::string> path;
+  for (const auto &stage : stages) {
+    std::vector<const PlanStep *> critical;
+    total += simulateStage(stage, critical);
+    for (const PlanStep *step : critical) {
+      std::ostringstream part;
+      part << step->status->name << " " << std::fixed << std::setprecision(1)
+           << step->seconds << "s";
+      path.push_back(part.str());
+    }
+    bool updates =
+        std::any_of(stage.begin(), stage.end(),
+                    [](const PlanStep &step) { return step.updates; });
+    if (g_staged && updates && !g_healthCommand.empty()) {
+      total += health;
+      std::ostringstream part;
+      part << "health check " << std::fixed << std::setprecision(1) << health
+           << "s";
+      path.push_back(part.str());
+    }
+  }
+
+  oss << "  Workers: " << std::min(workers, std::max<size_t>(1, steps.size()))
+      << (g_shards > 1 ? " per shard, " + std::to_string(g_shards) + " shards"
+                       : std::string())
+      << (g_staged ? ", staged in waves of " + std::to_string(g_waveSize)
+                   : std::string())
+      << "\n";
+  oss << "  Predicted wall time: " << std::fixed << std::setprecision(1)
+      << total << "s\n";
+  oss << "  Critical path: ";
+  for (size_t i = 0; i < path.size(); i++) {
+    oss << (i ? " -> " : "") << path[i];
+  }
+  oss << "\n";
+  if (estimated > 0) {
+    oss << "  No timings yet for " << estimated << " repositor"
+        << (estimated == 1 ? "y" : "ies") << "; defaults were assumed\n";
+  }
+  writeOutput(oss.str(), reportStream);
+}
+
+/**
+ * Print the learned upstream commit rate and fetch interval of every
+ * repository, most frequently fetched first
+ *
+ * @param results The vector of repository statuses
+ * @param reportStream Optional output file stream for the report
+ */
+void printFetchSchedule(const std::vector<RepoStatus> &results,
+                        std::ofstream *reportStream = nullptr) {
+  std::vector<RepoStatus> scheduled;
+  double fetchesPerHour = 0;
+  for (const auto &status : results) {
+    if (status.fetchInterval > 0) {
+      scheduled.push_back(status);
+      fetchesPerHour += 3600.0 / status.fetchInterval;
+    }
+  }
+  if (scheduled.empty()) {
+    return;
+  }
+  std::stable_sort(scheduled.begin(), scheduled.end(),
+                   [](const RepoStatus &a, const RepoStatus &b) {
+                     return a.fetchInterval < b.fetchInterval;
+                   });
+
+  std::ostringstream oss;
+  oss << "\nFETCH SCHEDULE:\n";
+  oss << "\n" << std::string(70, '=') << "\n";
+  oss << std::left << std::setw(30) << "Name" << std::setw(12) << "Type"
+      << std::setw(16) << "Commits/day"
+      << "Interval\n";
+  oss << std::string(70, '-') << "\n";
+  for (const auto &status : scheduled) {
+    std::ostringstream rate;
+    if (status.commitsPerDay >= 0) {
+      rate << std::fixed << std::setprecision(2) << status.commitsPerDay;
+    } else {
+      rate << "unknown";
+    }
+    oss << std::left << std::setw(30) << status.name << std::setw(12)
+        << status.type << std::setw(16) << rate.str()
+        << formatDuration(status.fetchInterval) << "\n";
+  }
+  oss << std::string(70, '=') << "\n";
+  oss << "  Fetches per hour: " << std::fixed << std::setprecision(1)
+      << fetchesPerHour;
+  if (g_fetchBudget > 0) {
+    oss << " (budget " << g_fetchBudget << ")";
+  }
+  oss << "\n";
+  writeOutput(oss.str(), reportStream);
+}
+
+/**
+ * Print a histogram of this run's fetch latencies, next to an estimate of
+ * the same fetches without hedging
+ *
+ * @param reportStream Optional output file stream for the report
+ */
+void printFetchLatency(std::ofstream *reportStream = nullptr) {
+  std::lock_guard<std::mutex> lock(g_fetchStatsMutex);
+  if (g_fetchStats.observedMs.empty()) {
+    return;
+  }
+
+  const std::vector<long long> bucketLimitsMs = {250,  500,  1000,  2000,
+                                                 4000, 8000, 16000, 32000};
+  auto bucketOf = [&bucketLimitsMs](long long ms) {
+    size_t bucket = 0;
+    while (bucket < bucketLimitsMs.size() && ms >= bucketLimitsMs[bucket]) {
+      bucket++;
+    }
+    return bucket;
+  };
+  std::vector<int> observed(bucketLimitsMs.size() + 1, 0);
+  std::vector<int> unhedged(bucketLimitsMs.size() + 1, 0);
+  long long observedTotal = 0, unhedgedTotal = 0;
+  for (size_t i = 0; i < g_fetchStats.observedMs.size(); i++) {
+    observed[bucketOf(g_fetchStats.observedMs[i])]++;
+    unhedged[bucketOf(g_fetchStats.unhedgedMs[i])]++;
+    observedTotal += g_fetchStats.observedMs[i];
+    unhedgedTotal += g_fetchStats.unhedgedMs[i];
+  }
+
+  std::ostringstream oss;
+  oss << "\nFETCH LATENCY:\n";
+  oss << "\n" << std::string(50, '=') << "\n";
+  oss << std::left << std::setw(14) << "Latency" << std::setw(12) << "Fetches"
+      << "Without hedging (est.)\n";
+  oss << std::string(50, '-') << "\n";
+  for (size_t bucket = 0; bucket < observed.size(); bucket++) {
+    std::string label =
+        bucket < bucketLimitsMs.size()
+            ? "< " + formatDuration(bucketLimitsMs[bucket] / 1000)
+            : ">= " + formatDuration(bucketLimitsMs.back() / 1000);
+    if (bucket < bucketLimitsMs.size() && bucketLimitsMs[bucket] < 1000) {
+      label = "< " + std::to_string(bucketLimitsMs[bucket]) + "ms";
+    }
+    oss << std::left << std::setw(14) << label << std::setw(12)
+        << observed[bucket] << unhedged[bucket] << "\n";
+  }
+  oss << std::string(50, '=') << "\n";
+  oss << "  Hedged fetches: " << g_fetchStats.hedged << " (won by the hedge: "
+      << g_fetchStats.hedgeWins << ")\n";
+  oss << "  Tail time removed by hedging (est.): "
+      << formatDuration((unhedgedTotal - observedTotal) / 1000) << "\n";
+  writeOutput(oss.str(), reportStream);
+}
+
+/**
+ * Update a specific extension or skin
+ *
+ * @param basePath The base MediaWiki installation path
+ * @param type The type of repository (core, extension, skin)
+ * @param name The name of the extension or skin (empty for core)
+ * @return 0 on success, 1 on error
+ */
+int updateSingleRepo(const fs::path &basePath, const std::string &type,
+                     const std::string &name) {
+  fs::path repoPath;
+  std::string displayName;
+
+  if (type == "core") {
+    repoPath = basePath;
+    displayName = "MediaWiki core";
+  } else if (type == "extension") {
+    repoPath = basePath / "extensions" / name;
+    displayName = "extension '" + name + "'";
+  } else if (type == "skin") {
+    repoPath = basePath / "skins" / name;
+    displayName = "skin '" + name + "'";
+  } else {
+    std::cerr << "Error: Invalid type '" << type
+              << "'. Must be 'core', 'extension', or 'skin'.\n";
+    return 1;
+  }
+
+  if (!fs::exists(repoPath)) {
+    std::cerr << "Error: " << displayName
+              << " not found at: " << repoPath.string() << "\n";
+    return 1;
+  }
+
+  if (!fs::is_directory(repoPath)) {
+    std::cerr << "Error: Path exists but is not a directory: "
+              << repoPath.string() << "\n";
+    return 1;
+  }
+
+  std::cout << "Checking " << displayName << " at: " << repoPath.string()
+            << "\n";
+
+  RepoStatus status = checkRepository(repoPath, type);
+
+  if (!status.isRepo) {
+    std::cerr << "Error: Not a git repository\n";
+    return 1;
+  }
+
+  if (!status.error.empty()) {
+    std::cerr << "Error: " << status.error << "\n";
+    return 1;
+  }
+
+  std::cout << "\nRepository Status:\n";
+  std::cout << "  Branch: " << status.currentBranch << "\n";
+  std::cout << "  Uncommitted changes: "
+            << (status.hadUncommittedChanges ? "Yes" : "No") << "\n";
+  std::cout << "  Commits behind: "
+            << (status.behindBy >= 0 ? std::to_string(status.behindBy)
+                                     : "Unknown")
+            << "\n";
+
+  if (status.behindBy <= 0) {
+    std::cout << "\n✅ Already up to date!\n";
+    return 0;
+  }
+
+  if (status.incompatible) {
+    std::cerr << "\n⛔ The update needs MediaWiki " << status.requiresMediaWiki
+              << ", but " << g_coreVersion << " is installed.\n";
+    std::cerr << "Update core first, or use --no-compat-check to pull "
+                 "anyway.\n";
+    return 1;
+  }
+
+  // Prompt user
+  std::ostringstream prompt;
+  prompt << "\nPull " << status.behindBy << " commit"
+         << (status.behindBy > 1 ? "s" : "") << "?";
+  if (status.hadUncommittedChanges) {
+    prompt << "\n  ⚠️  WARNING: Repository has uncommitted changes!";
+  }
+  prompt << "\n  ";
+
+  bool confirmed = g_autoYes || promptForConfirmation(prompt.str());
+
+  if (!confirmed) {
+    std::cout << "Update cancelled.\n";
+    return 0;
+  }
+
+  std::cout << "Pulling updates...\n";
+  std::string pullError;
+  if (performGitPull(repoPath, pullError, nullptr,
+                     updateStrategyFor(type, name))) {
+    std::cout << "\n✅ Successfully updated!\n";
+    return 0;
+  } else {
+    std::cerr << "\n❌ Pull failed:\n" << pullError << "\n";
+    return 1;
+  }
+}
+
+// How a file was copied into a replica install
+enum class CopyMethod { Reflink, Hardlink, Copy };
+
+/**
+ * Clone a file's data into a new file sharing the same disk blocks, on
+ * filesystems that support it (btrfs, XFS, APFS)
+ *
+ * @param source The file to clone
+ * @param dest The new file (must not exist)
+ * @return true if the clone was made
+ */
+bool reflinkFile(const fs::path &source, const fs::path &dest) {
+#if defined(__linux__) && defined(FICLONE)
+  int sourceFd = open(source.c_str(), O_RDONLY);
+  if (sourceFd < 0) {
+    return false;
+  }
+  int destFd = open(dest.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (destFd < 0) {
+    close(sourceFd);
+    return false;
+  }
+  bool cloned = ioctl(destFd, FICLONE, sourceFd) == 0;
+  close(sourceFd);
+  close(destFd);
+  if (!cloned) {
+    unlink(dest.c_str());
+  }
+  return cloned;
+#elif defined(__APPLE__)
+  return clonefile(source.c_str(), dest.c_str(), 0) == 0;
+#else
+  (void)source;
+  (void)dest;
+  return false;
+#endif
+}
+
+/**
+ * Put a copy of a file from the primary install into a replica, replacing
+ * any existing file atomically
+ *
+ * Reflinks are tried first, then hard links (only with
+ * --replicate-hardlinks, as the installs then share the file), then a plain
+ * copy. Permissions are copied, and symlinks are recreated as symlinks.
+ *
+ * @param source The file in the primary install
+ * @param dest The file in the replica
+ * @param method Receives how the file was copied
+ * @return true on success
+ */
+bool replicateFile(const fs::path &source, const fs::path &dest,
+                   CopyMethod &method) {
+  std::error_code ec;
+  fs::create_directories(dest.parent_path(), ec);
+  fs::path temp = dest;
+  temp += ".local_mw-" + std::to_string(getpid()) + ".tmp";
+  fs::remove(temp, ec);
+
+  method = CopyMethod::Copy;
+  if (fs::is_symlink(source, ec)) {
+    fs::create_symlink(fs::read_symlink(source, ec), temp, ec);
+  } else if (reflinkFile(source, temp)) {
+    method = CopyMethod::Reflink;
+  } else {
+    if (g_replicateHardlinks) {
+      fs::create_hard_link(source, temp, ec);
+      method = ec ? CopyMethod::Copy : CopyMethod::Hardlink;
+    }
+    if (method == CopyMethod::Copy) {
+      ec.clear();
+      fs::copy_file(source, temp, fs::copy_options::overwrite_existing, ec);
+    }
+  }
+  if (!ec && method != CopyMethod::Hardlink && !fs::is_symlink(temp, ec)) {
+    fs::permissions(temp, fs::status(source, ec).permissions(), ec);
+  }
+  if (!ec) {
+    fs::rename(temp, dest, ec);
+  }
+  if (ec) {
+    fs::remove(temp, ec);
+    return false;
+  }
+  return true;
+}
+
+struct ReplicationResult {
+  std::string name;
+  std::string replica;
+  std::string error;
+  int filesWritten = 0;
+  int filesRemoved = 0;
+  int reflinked = 0;
+  int hardlinked = 0;
+};
+
+/**
+ * Write blobs from a repository's object database into files, streaming
+ * each one through `git cat-file --batch` so no blob is held in memory
+ *
+ * Each file is written next to its destination and renamed over it.
+ * Symlink blobs (mode 120000) become symlinks to their contents.
+ *
+ * @param repoPath The repository holding the objects
+ * @param blobs (blob id, destination, mode) of each file
+ * @param problem Receives a description of what went wrong
+ * @return true if every file was written
+ */
+bool writeBlobs(
+    const fs::path &repoPath,
+    const std::vector<std::tuple<std::string, fs::path, std::string>> &blobs,
+    std::string &problem) {
+  if (blobs.empty()) {
+    return true;
+  }
+  char listPath[] = "/tmp/local_mw-blobs-XXXXXX";
+  int listFd = mkstemp(listPath);
+  if (listFd < 0) {
+    problem = "could not create a temporary file";
+    return false;
+  }
+  std::string list;
+  for (const auto &blob : blobs) {
+    list += std::get<0>(blob) + "\n";
+  }
+  bool listed = write(listFd, list.data(), list.size()) ==
+                static_cast<ssize_t>(list.size());
+  close(listFd);
+  std::string cmd = "cd \"" + repoPath.string() +
+                    "\" && git cat-file --batch < \"" + listPath +
+                    "\" 2>/dev/null";
+  if (g_verbose) {
+    logVerbose("  [CMD] " + cmd);
+  }
+  FILE *pipe = listed ? openCommand(cmd) : nullptr;
+  if (!pipe) {
+    unlink(listPath);
+    problem = "could not read objects";
+    return false;
+  }
+
+  std::array<char, 65536> buffer;
+  bool ok = true;
+  for (const auto &[oid, dest, mode] : blobs) {
+    // "<oid> blob <size>" (or "<oid> missing")
+    std::string header;
+    int c;
+    while ((c = fgetc(pipe)) != EOF && c != '\n') {
+      header += static_cast<char>(c);
+    }
+    std::istringstream fields(header);
+    std::string gotOid, type;
+    long long size = -1;
+    fields >> gotOid >> type >> size;
+    if (type != "blob" || size < 0) {
+      problem = "missing object " + oid;
+      ok = false;
+      break;
+    }
+
+    std::error_code ec;
+    fs::create_directories(dest.parent_path(), ec);
+    fs::path temp = dest;
+    temp += ".local_mw-" + std::to_string(getpid()) + ".tmp";
+    fs::remove(temp, ec);
+    std::string target;
+    FILE *file = mode == "120000" ? nullptr : fopen(temp.c_str(), "wb");
+    bool written = mode == "120000" || file;
+    for (long long left = size; left > 0;) {
+      size_t chunk =
+          static_cast<size_t>(std::min<long long>(left, buffer.size()));
+      size_t got = fread(buffer.data(), 1, chunk, pipe);
+      if (got == 0) {
+        written = false;
+        left = 0;
+        break;
+      }
+      if (file) {
+        written = written && fwrite(buffer.data(), 1, got, file) == got;
+      } else {
+        target.append(buffer.data(), got);
+      }
+      left -= static_cast<long long>(got);
+    }
+    fgetc(pipe); // The newline after the contents
+    if (file) {
+      written = fclose(file) == 0 && written;
+      fs::permissions(temp,
+                      mode == "100755" ? fs::perms(0755) : fs::perms(0644),
+                      ec);
+    } else if (written) {
+      fs::create_symlink(target, temp, ec);
+    }
+    if (written && !ec) {
+      fs::rename(temp, dest, ec);
+    }
+    if (!written || ec) {
+      fs::remove(temp, ec);
+      problem = "could not write " + dest.string();
+      ok = false;
+      break;
+    }
+  }
+  pclose(pipe);
+  unlink(listPath);
+  return ok;
+}
+
+/**
+ * Remove the empty directories left above a deleted file, up to (not
+ * including) the repository root
+ *
+ * @param repoPath The repository root
+ * @param path The deleted file
+ */
+void pruneEmptyParents(const fs::path &repoPath, fs::path path) {
+  std::error_code ec;
+  for (path = path.parent_path(); path != repoPath && path != path.root_path();
+       path = path.parent_path()) {
+    // Only succeeds while the directory is empty
+    if (!fs::remove(path, ec) || ec) {
+      break;
+    }
+  }
+}
+
+/**
+ * Bring one repository of a replica install up to date with the primary,
+ * without the replica contacting a remote
+ *
+ * The replica must be on the same branch, at the primary's pre-pull commit,
+ * and clean. Objects are fetched from the primary checkout and the files
+ * the pull changed are written from them (new files first, then
+ * deletions); only files whose primary copy still matches the commit are
+ * reflinked or hard linked from it. Finally the index and HEAD are moved to
+ * the new commit. Submodules are left alone, and replicas with a sparse
+ * checkout are updated by git itself so their patterns are respected.
+ *
+ * If any step fails, the replica is reset to its old commit and the files
+ * created so far are removed.
+ *
+ * @param status The primary repository's status after pulling
+ * @param primaryRepo The repository in the primary install
+ * @param replicaRepo The same repository in the replica install
+ * @param result Receives the outcome
+ */
+void replicateRepository(const RepoStatus &status,
+                         const fs::path &primaryRepo,
+                         const fs::path &replicaRepo,
+                         ReplicationResult &result) {
+  if (!isGitRepo(replicaRepo)) {
+    result.error = "Not a git repository in replica";
+    return;
+  }
+  if (readHeadBranch(replicaRepo) != status.currentBranch ||
+      readRefOid(replicaRepo, "HEAD") != status.headOid) {
+    result.error = "Replica is not at the primary's pre-pull commit";
+    return;
+  }
+  const std::string upstreamRef = "refs/remotes/origin/" + status.currentBranch;
+  if (readRefOid(primaryRepo, upstreamRef) != status.pulledOid) {
+    result.error = "Pull was not a fast-forward";
+    return;
+  }
+  const std::string replicaCd = "cd \"" + replicaRepo.string() + "\" && ";
+  const std::string primaryCd = "cd \"" + primaryRepo.string() + "\" && ";
+  if (!execCommand(replicaCd + "git status --porcelain --untracked-files=no "
+                               "2>/dev/null")
+           .empty()) {
+    result.error = "Replica has uncommitted changes";
+    return;
+  }
+  auto git = [&](const std::string &cmd, GitFailure &failure) {
+    return runClassified(
+        [&](int &exitStatus) { return execCommand(cmd, &exitStatus); },
+        failure);
+  };
+
+  // Objects and the upstream ref come from the primary's checkout
+  std::error_code ec;
+  std::string primaryPath = fs::absolute(primaryRepo, ec).string();
+  GitFailure failure;
+  git(replicaCd + "git fetch --no-tags \"" + primaryPath + "\" +" +
+          upstreamRef + ":" + upstreamRef + " 2>&1",
+      failure);
+  if (failure != GitFailure::None) {
+    result.error =
+        "Could not fetch objects from primary: " + describeFailure(failure);
+    return;
+  }
+
+  std::vector<fs::path> created;
+  auto rollBack = [&](const std::string &problem) {
+    GitFailure ignored;
+    git(replicaCd + "git reset -q --hard " + status.headOid + " 2>&1",
+        ignored);
+    for (const auto &path : created) {
+      fs::remove(path, ec);
+      pruneEmptyParents(replicaRepo, path);
+    }
+    result.error = problem + (ignored == GitFailure::None
+                                  ? " (rolled back)"
+                                  : " (rollback failed)");
+  };
+
+  std::string sparse =
+      execCommand(replicaCd + "git config --bool core.sparseCheckout");
+  if (sparse.compare(0, 4, "true") == 0) {
+    std::string output =
+        git(replicaCd + "git read-tree -m -u " + status.headOid + " " +
+                status.pulledOid + " 2>&1 && git update-ref -m \"local_mw: " +
+                "replicated from " + primaryPath + "\" HEAD " +
+                status.pulledOid + " " + status.headOid + " 2>&1",
+            failure);
+    if (failure != GitFailure::None) {
+      rollBack("Could not update sparse checkout: " +
+               output.substr(0, output.find('\n')));
+    }
+    return;
+  }
+
+  // Changed entries as ":<old mode> <new mode> <old id> <new id> <status>"
+  // and path, NUL-separated
+  std::string diff =
+      execCommand(replicaCd + "git diff-tree -r -z --no-renames " +
+                  status.headOid + " " + status.pulledOid + " 2>/dev/null");
+  struct Change {
+    std::string mode, oid, path;
+    bool removed;
+  };
+  std::vector<Change> changes;
+  for (size_t pos = 0; pos < diff.size();) {
+    size_t metaEnd = diff.find('\0', pos);
+    size_t pathEnd = diff.find('\0', metaEnd + 1);
+    if (metaEnd == std::string::npos || pathEnd == std::string::npos) {
+      break;
+    }
+    std::istringstream meta(diff.substr(pos + 1, metaEnd - pos - 1));
+    std::string oldMode, newMode, oldOid, newOid, change;
+    meta >> oldMode >> newMode >> oldOid >> newOid >> change;
+    std::string path = diff.substr(metaEnd + 1, pathEnd - metaEnd - 1);
+    bool removed = change == "D";
+    // Submodules are repositories of their own
+    if ((removed ? oldMode : newMode) != "160000") {
+      changes.push_back({newMode, newOid, path, removed});
+    }
+    pos = pathEnd + 1;
+  }
+
+  // Paths whose primary copy differs from the commit (local edits) must
+  // not be shared; everything else present in the primary can be
+  std::set<std::string> primaryDiffers;
+  std::string dirty = execCommand(primaryCd + "git diff --name-only -z " +
+                                  status.pulledOid + " 2>/dev/null");
+  for (size_t pos = 0; pos < dirty.size();) {
+    size_t end = dirty.find('\0', pos);
+    if (end == std::string::npos) {
+      break;
+    }
+    primaryDiffers.insert(dirty.substr(pos, end - pos));
+    pos = end + 1;
+  }
+
+  // New and changed files go in before old ones are removed, so a serving
+  // install never sees a file missing that the new code expects
+  std::vector<std::tuple<std::string, fs::path, std::string>> fromObjects;
+  for (const auto &change : changes) {
+    if (change.removed) {
+      continue;
+    }
+    fs::path dest = replicaRepo / change.path;
+    if (!fs::exists(fs::symlink_status(dest, ec))) {
+      created.push_back(dest);
+    }
+    fs::path source = primaryRepo / change.path;
+    CopyMethod method;
+    if (primaryDiffers.count(change.path) ||
+        !fs::exists(fs::symlink_status(source, ec))) {
+      fromObjects.emplace_back(change.oid, dest, change.mode);
+    } else if (!replicateFile(source, dest, method)) {
+      rollBack("Could not write " + change.path);
+      return;
+    } else {
+      result.reflinked += method == CopyMethod::Reflink ? 1 : 0;
+      result.hardlinked += method == CopyMethod::Hardlink ? 1 : 0;
+    }
+    result.filesWritten++;
+  }
+  std::string problem;
+  if (!writeBlobs(replicaRepo, fromObjects, problem)) {
+    rollBack("Could not write files: " + problem);
+    return;
+  }
+  for (const auto &change : changes) {
+    if (change.removed) {
+      fs::remove(replicaRepo / change.path, ec);
+      pruneEmptyParents(replicaRepo, replicaRepo / change.path);
+      result.filesRemoved++;
+    }
+  }
+
+  // The working tree now matches the new commit: move the index (only the
+  // changed entries are touched; --reset as their files were rewritten
+  // behind git's back) and HEAD there, then refresh stat data
+  std::string output =
+      git(replicaCd + "git read-tree --reset " + status.headOid + " " +
+              status.pulledOid + " 2>&1 && git update-ref -m \"local_mw: " +
+              "replicated from " + primaryPath + "\" HEAD " +
+              status.pulledOid + " " + status.headOid +
+              " 2>&1 && git update-index -q --refresh 2>&1",
+          failure);
+  if (failure != GitFailure::None) {
+    rollBack("Could not update index and HEAD: " +
+             output.substr(0, output.find('\n')));
+  }
+}
+
+/**
+ * Replicate every pulled repository of the primary install to the replica
+ * installs, in parallel
+ *
+ * @param basePath The primary MediaWiki installation path
+ * @param results The statuses of the primary's repositories
+ * @param reportStream Optional output file stream for the report
+ * @return The number of repositories that could not be replicated
+ */
+int replicatePulls(const fs::path &basePath,
+                   const std::vector<RepoStatus> &results,
+                   std::ofstream *reportStream = nullptr) {
+  std::vector<const RepoStatus *> pulled;
+  for (const auto &status : results) {
+    if (status.pulled && !status.pulledOid.empty() &&
+        status.pulledOid != status.headOid) {
+      pulled.push_back(&status);
+    }
+  }
+
+  std::vector<ReplicationResult> replicated(pulled.size() *
+                                            g_replicaPaths.size());
+  runInParallel(replicated.size(), [&](size_t i) {
+    const RepoStatus &status = *pulled[i / g_replicaPaths.size()];
+    const std::string &replica = g_replicaPaths[i % g_replicaPaths.size()];
+    std::error_code ec;
+    fs::path relative = fs::relative(status.path, basePath, ec);
+    ReplicationResult &result = replicated[i];
+    result.name = status.name;
+    result.replica = replica;
+    replicateRepository(status, status.path, fs::path(replica) / relative,
+                        result);
+  });
+
+  std::ostringstream oss;
+  oss << "\nREPLICATION:\n";
+  if (replicated.empty()) {
+    oss << "Nothing was pulled, so there is nothing to replicate.\n";
+    writeOutput(oss.str(), reportStream);
+    return 0;
+  }
+  oss << "\n" << std::string(100, '=') << "\n";
+  oss << std::left << std::setw(30) << "Name" << std::setw(30) << "Replica"
+      << "Result\n";
+  oss << std::string(100, '-') << "\n";
+  int failures = 0;
+  for (const auto &result : replicated) {
+    oss << std::left << std::setw(30) << result.name << std::setw(30)
+        << result.replica;
+    if (!result.error.empty()) {
+      oss << "❌ " << result.error << "\n";
+      failures++;
+    } else {
+      oss << "✅ " << result.filesWritten << " written ("
+          << result.reflinked << " reflinked, " << result.hardlinked
+          << " hard linked), " << result.filesRemoved << " removed\n";
+    }
+  }
+  oss << std::string(100, '=') << "\n";
+  writeOutput(oss.str(), reportStream);
+  return failures;
+}
+
+/**
+ * List the directories of HEAD's tree directly below a directory
+ *
+ * @param repoPath The repository path
+ * @param dir The directory, relative to the repository root ("" for root)
+ * @return Paths relative to the repository root
+ */
+std::vector<std::string> listTreeDirectories(const fs::path &repoPath,
+                                             const std::string &dir) {
+  std::vector<std::string> dirs;
+  std::string cmd = "cd \"" + repoPath.string() +
+                    "\" && git ls-tree -d --name-only HEAD" +
+                    (dir.empty() ? "" : " -- \"" + dir + "/\"") +
+                    " 2>/dev/null";
+  streamCommandLines(cmd, [&dirs](const std::string &line) {
+    if (!line.empty()) {
+      dirs.push_back(line);
+    }
+  });
+  return dirs;
+}
+
+/**
+ * Work out the cone-mode sparse-checkout directories that keep everything
+ * except the excluded paths
+ *
+ * Cone mode can only name directories to include, so each directory on the
+ * way to an excluded path is expanded into its other subdirectories (files
+ * directly inside those parents stay checked out).
+ *
+ * @param repoPath The repository path
+ * @param excludes Directories to leave out, relative to the repository root
+ * @param dir The directory being expanded ("" for the root)
+ * @param included Receives the directories to include
+ */
+void computeConeDirectories(const fs::path &repoPath,
+                            const std::vector<std::string> &excludes,
+                            const std::string &dir,
+                            std::vector<std::string> &included) {
+  for (const std::string &child : listTreeDirectories(repoPath, dir)) {
+    bool excluded = false;
+    bool containsExclude = false;
+    for (const std::string &exclude : excludes) {
+      excluded = excluded || exclude == child;
+      containsExclude = containsExclude ||
+                        exclude.compare(0, child.size() + 1, child + "/") == 0;
+    }
+    if (excluded) {
+      continue;
+    }
+    if (containsExclude) {
+      computeConeDirectories(repoPath, excludes, child, included);
+    } else {
+      included.push_back(child);
+    }
+  }
+}
+
+struct WorkingTreeSize {
+  long long files = 0;
+  long long bytes = 0;
+};
+
+/**
+ * Measure the files checked out in a working tree, skipping .git and any
+ * nested repositories (such as extensions inside core)
+ *
+ * @param repoPath The repository path
+ * @return The number and total size of files
+ */
+WorkingTreeSize measureWorkingTree(const fs::path &repoPath) {
+  WorkingTreeSize size;
+  std::error_code ec;
+  fs::recursive_directory_iterator it(
+      repoPath, fs::directory_options::skip_permission_denied, ec);
+  for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+    const fs::directory_entry &entry = *it;
+    if (entry.is_symlink(ec)) {
+      continue;
+    }
+    if (entry.is_directory(ec)) {
+      if (entry.path().filename() == ".git" ||
+          fs::exists(entry.path() / ".git", ec)) {
+        it.disable_recursion_pending();
+      }
+      continue;
+    }
+    if (entry.is_regular_file(ec)) {
+      size.files++;
+      size.bytes += static_cast<long long>(entry.file_size(ec));
+    }
+  }
+  return size;
+}
+
+/**
+ * Time a `git status` run
+ *
+ * @param repoPath The repository path
+ * @return The wall-clock time in milliseconds
+ */
+long long timeStatusMs(const fs::path &repoPath) {
+  auto start = std::chrono::steady_clock::now();
+  hasUncommittedChanges(repoPath);
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+/**
+ * Format a byte count compactly ("512 B", "3.4 MB")
+ *
+ * @param bytes The byte count
+ * @return The formatted size
+ */
+std::string formatBytes(long long bytes) {
+  const char *units[] = {"B", "KB", "MB", "GB"};
+  double value = static_cast<double>(bytes);
+  int unit = 0;
+  while (value >= 1024 && unit < 3) {
+    value /= 1024;
+    unit++;
+  }
+  std::ostringstream oss;
+  oss << std::fixed << std::setprecision(unit == 0 ? 0 : 1) << value << " "
+      << units[unit];
+  return oss.str();
+}
+
+struct SparseResult {
+  std::string name;
+  std::string error;
+  size_t cones = 0;
+  WorkingTreeSize before;
+  WorkingTreeSize after;
+  long long statusMsBefore = 0;
+  long long statusMsAfter = 0;
+};
+
+/**
+ * Apply sparse-checkout profiles to every repository that has one, in
+ * parallel, and report how working tree size and status latency changed
+ *
+ * The profile file has one "<repo> <directory...>" line per repository,
+ * naming directories to leave out of the working tree. Running it again
+ * re-applies the profiles, so it can be used to keep them in place.
+ *
+ * @param basePath The MediaWiki installation path
+ * @param profilePath The profile file
+ * @return 0 on success, 1 if any profile could not be applied
+ */
+int applySparseProfiles(const fs::path &basePath,
+                        const std::string &profilePath) {
+  RepoRules profiles;
+  if (!loadRepoRules(profilePath, profiles)) {
+    std::cerr << "Error: Could not read sparse profile file: " << profilePath
+              << "\n";
+    return 1;
+  }
+  if (!gitVersionAtLeast(2, 27)) {
+    std::cerr << "Error: Sparse-checkout profiles need git 2.27 or newer\n";
+    return 1;
+  }
+  // The sparse index keeps the index itself small too, where supported.
+  // `set` only takes --cone and --sparse-index from git 2.35; before that
+  // they go to `init`, which then leaves `set` in cone mode.
+  const std::string sparseIndex =
+      gitVersionAtLeast(2, 32) ? " --sparse-index" : "";
+  const std::string setCommand =
+      gitVersionAtLeast(2, 35)
+          ? "git sparse-checkout set --cone" + sparseIndex
+          : "git sparse-checkout init --cone" + sparseIndex +
+                " 2>&1 && git sparse-checkout set";
+
+  std::vector<RepoTarget> targets;
+  std::vector<std::vector<std::string>> excludes;
+  for (const auto &target : collectTargets(basePath, false)) {
+    std::string name = target.name.empty() ? target.path.filename().string()
+                                           : target.name;
+    const std::vector<std::string> *rule =
+        findRepoRule(profiles, target.type, name);
+    if (rule && !rule->empty() && isGitRepo(target.path)) {
+      std::vector<std::string> dirs;
+      for (std::string dir : *rule) {
+        while (!dir.empty() && dir.back() == '/') {
+          dir.pop_back();
+        }
+        dirs.push_back(dir);
+      }
+      targets.push_back({target.path, target.type, name});
+      excludes.push_back(dirs);
+    }
+  }
+  std::cout << "Applying sparse-checkout profiles to " << targets.size()
+            << " repositories...\n";
+
+  std::vector<SparseResult> results(targets.size());
+  runInParallel(targets.size(), [&](size_t i) {
+    SparseResult &result = results[i];
+    const fs::path &repoPath = targets[i].path;
+    result.name = targets[i].name;
+    result.before = measureWorkingTree(repoPath);
+    result.statusMsBefore = timeStatusMs(repoPath);
+
+    std::vector<std::string> cones;
+    computeConeDirectories(repoPath, excludes[i], "", cones);
+    result.cones = cones.size();
+    std::string cmd = "cd \"" + repoPath.string() + "\" && " + setCommand;
+    for (const auto &cone : cones) {
+      cmd += " \"" + cone + "\"";
+    }
+    cmd += " 2>&1";
+    GitFailure failure;
+    std::string output = runClassified(
+        [&cmd](int &exitStatus) { return execCommand(cmd, &exitStatus); },
+        failure);
+    if (failure != GitFailure::None) {
+      result.error = failure == GitFailure::Other
+                         ? output.substr(0, output.find('\n'))
+                         : describeFailure(failure);
+    }
+
+    result.after = measureWorkingTree(repoPath);
+    result.statusMsAfter = timeStatusMs(repoPath);
+  });
+
+  std::ostringstream oss;
+  oss << "\nSPARSE CHECKOUT:\n";
+  oss << "\n" << std::string(100, '=') << "\n";
+  oss << std::left << std::setw(30) << "Name" << std::setw(24) << "Files"
+      << std::setw(26) << "Size"
+      << "Status time\n";
+  oss << std::string(100, '-') << "\n";
+  int failures = 0;
+  for (const auto &result : results) {
+    oss << std::left << std::setw(30) << result.name;
+    if (!result.error.empty()) {
+      oss << "❌ " << result.error << "\n";
+      failures++;
+      continue;
+    }
+    oss << std::setw(24)
+        << (std::to_string(result.before.files) + " -> " +
+            std::to_string(result.after.files))
+        << std::setw(26)
+        << (formatBytes(result.before.bytes) + " -> " +
+            formatBytes(result.after.bytes))
+        << result.statusMsBefore << "ms -> " << result.statusMsAfter << "ms\n";
+  }
+  oss << std::string(100, '=') << "\n";
+  writeOutput(oss.str());
+
+  return failures > 0 ? 1 : 0;
+}
+
+struct MigrationResult {
+  std::string name;
+  std::string oldUrl;
+  std::string newUrl;
+  std::string error;
+  bool switched = false;
+};
+
+/**
+ * Repoint the origin remote of every repository that has a migration rule,
+ * after checking in parallel that the new remote already has the commit
+ * origin/<branch> points at
+ *
+ * The rules file has "<repo> <old prefix> <new prefix> ..." lines; the
+ * first old prefix the current URL starts with is replaced by its new
+ * prefix. Repositories whose new remote is missing or behind are reported
+ * and left untouched. With --report-only nothing is switched.
+ *
+ * @param basePath The MediaWiki installation path
+ * @param rulesPath The rules file
+ * @return 0 on success, 1 if any repository could not be migrated
+ */
+int migrateRemotes(const fs::path &basePath, const std::string &rulesPath) {
+  RepoRules rules;
+  if (!loadRepoRules(rulesPath, rules)) {
+    std::cerr << "Error: Could not read remote migration rules: " << rulesPath
+              << "\n";
+    return 1;
+  }
+
+  std::vector<RepoTarget> targets;
+  std::vector<const std::vector<std::string> *> mappings;
+  for (const auto &target : collectTargets(basePath, false)) {
+    std::string name = target.name.empty() ? target.path.filename().string()
+                                           : target.name;
+    const std::vector<std::string> *rule =
+        findRepoRule(rules, target.type, name);
+    if (rule && !rule->empty() && isGitRepo(target.path)) {
+      targets.push_back({target.path, target.type, name});
+      mappings.push_back(rule);
+    }
+  }
+  std::cout << "Verifying new remotes for " << targets.size()
+            << " repositories...\n";
+
+  std::vector<MigrationResult> results(targets.size());
+  runInParallel(targets.size(), [&](size_t i) {
+    MigrationResult &result = results[i];
+    const fs::path &repoPath = targets[i].path;
+    const std::vector<std::string> &mapping = *mappings[i];
+    result.name = targets[i].name;
+    result.oldUrl = readRemoteUrl(repoPath);
+    if (result.oldUrl.empty()) {
+      result.error = "No origin remote";
+      return;
+    }
+    if (mapping.size() % 2 != 0) {
+      result.error = "Rule needs old/new prefix pairs";
+      return;
+    }
+    for (size_t j = 0; j < mapping.size(); j += 2) {
+      if (result.oldUrl.compare(0, mapping[j].size(), mapping[j]) == 0) {
+        result.newUrl =
+            mapping[j + 1] + result.oldUrl.substr(mapping[j].size());
+        break;
+      }
+    }
+    if (result.newUrl.empty() || result.newUrl == result.oldUrl) {
+      result.error = "No rule matches the current URL";
+      for (size_t j = 1; j < mapping.size(); j += 2) {
+        if (result.oldUrl.compare(0, mapping[j].size(), mapping[j]) == 0) {
+          result.error = "Already migrated";
+        }
+      }
+      return;
+    }
+
+    std::string branch = readHeadBranch(repoPath);
+    std::string expected =
+        readRefOid(repoPath, "refs/remotes/origin/" + branch);
+    if (branch.empty() || branch == "HEAD" || expected.empty()) {
+      result.error = "No upstream commit to compare against";
+      return;
+    }
+
+    // Ask the new remote for just this one ref
+    std::string output = execCommand("cd \"" + repoPath.string() +
+                                     "\" && git ls-remote \"" + result.newUrl +
+                                     "\" refs/heads/" + branch + " 2>&1");
+    std::string advertised = output.substr(0, output.find_first_of(" \t\n"));
+    if (advertised.size() < 40 ||
+        advertised.find_first_not_of("0123456789abcdef") !=
+            std::string::npos) {
+      result.error = "New remote unreachable or has no " + branch;
+      return;
+    }
+    if (advertised != expected) {
+      result.error = "New remote has " + advertised.substr(0, 10) +
+                     ", origin has " + expected.substr(0, 10);
+      return;
+    }
+
+    if (g_reportOnly) {
+      return;
+    }
+    std::string setOutput = execWithLockRetry(
+        "cd \"" + repoPath.string() + "\" && git remote set-url origin \"" +
+        result.newUrl + "\" 2>&1");
+    if (!setOutput.empty()) {
+      result.error = setOutput.substr(0, setOutput.find('\n'));
+      return;
+    }
+    result.switched = true;
+  });
+
+  std::ostringstream oss;
+  oss << "\nREMOTE MIGRATION:\n";
+  oss << "\n" << std::string(100, '=') << "\n";
+  oss << std::left << std::setw(30) << "Name" << std::setw(50) << "New URL"
+      << "Status\n";
+  oss << std::string(100, '-') << "\n";
+  int failures = 0;
+  for (const auto &result : results) {
+    oss << std::left << std::setw(30) << result.name << std::setw(50)
+        << (result.newUrl.empty() ? result.oldUrl : result.newUrl);
+    if (result.error == "Already migrated") {
+      oss << "✅ " << result.error << "\n";
+    } else if (!result.error.empty()) {
+      oss << "❌ " << result.error << "\n";
+      failures++;
+    } else if (result.switched) {
+      oss << "✅ Switched\n";
+    } else {
+      oss << "🔍 Verified (report-only, not switched)\n";
+    }
+  }
+  oss << std::string(100, '=') << "\n";
+  writeOutput(oss.str());
+
+  return failures > 0 ? 1 : 0;
+}
+
+/**
+ * Fingerprint the state of every repository in the installation
+ *
+ * Only ref files and stat data are read, never objects or the working tree,
+ * and no git process is started, so this stays in the milliseconds even on
+ * installations with hundreds of repositories. Upstream oids are the
+ * remote-tracking refs left by the last fetch (a sweep or the daemon).
+ *
+ * @param basePath The MediaWiki installation path
+ * @return 0 on success
+ */
+int printFingerprint(const fs::path &basePath) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const auto &target : collectTargets(basePath, false)) {
+    fnv1aMix(hash, target.path.string());
+    fs::path gitDir = resolveGitDir(target.path);
+    if (gitDir.empty()) {
+      continue;
+    }
+    std::string branch = readHeadBranch(target.path);
+    fnv1aMix(hash, branch);
+    fnv1aMix(hash, readRefOid(target.path, "HEAD"));
+    fnv1aMix(hash, readRefOid(target.path, "refs/remotes/origin/" + branch));
+
+    // Staging, checkouts and status refreshes all rewrite the index
+    struct stat indexStat;
+    if (stat((gitDir / "index").c_str(), &indexStat) == 0) {
+#ifdef __APPLE__
+      long mtimeNs = indexStat.st_mtimespec.tv_nsec;
+#else
+      long mtimeNs = indexStat.st_mtim.tv_nsec;
+#endif
+      fnv1aMix(hash, std::to_string(indexStat.st_size) + ":" +
+                         std::to_string(indexStat.st_mtime) + "." +
+                         std::to_string(mtimeNs));
+    }
+  }
+
+  std::ostringstream oss;
+  oss << std::hex << std::setw(16) << std::setfill('0') << hash;
+  std::cout << oss.str() << "\n";
+  return 0;
+}
+
+// Frames sent from shard workers to the coordinator: a type byte, a 32-bit
+// payload length, then the payload. Integers are little-endian 32-bit (64
+// for sizes and times), strings are length-prefixed.
+const char FRAME_RESULT = 'R';
+const char FRAME_TOTALS = 'T';
+const char FRAME_END = 'E';
+
+/**
+ * Append a little-endian integer to a frame payload
+ *
+ * @param out The payload
+ * @param value The value
+ * @param bytes Its width in bytes
+ */
+void frameAppendInt(std::string &out, long long value, int bytes = 4) {
+  for (int i = 0; i < bytes; i++) {
+    out += static_cast<char>((static_cast<unsigned long long>(value) >>
+                              (8 * i)) &
+                             0xff);
+  }
+}
+
+/**
+ * Append a length-prefixed string to a frame payload
+ *
+ * @param out The payload
+ * @param value The string
+ */
+void frameAppendString(std::string &out, const std::string &value) {
+  frameAppendInt(out, static_cast<long long>(value.size()));
+  out += value;
+}
+
+// Reads the fields of a frame payload back in the order they were appended.
+// Reading past the end sets ok to false and yields zero values.
+struct FrameReader {
+  const std::string &data;
+  size_t pos = 0;
+  bool ok = true;
+
+  long long readInt(int bytes = 4) {
+    if (pos + bytes > data.size()) {
+      ok = false;
+      return 0;
+    }
+    unsigned long long value = 0;
+    for (int i = 0; i < bytes; i++) {
+      value |= static_cast<unsigned long long>(
+                   static_cast<unsigned char>(data[pos + i]))
+               << (8 * i);
+    }
+    pos += bytes;
+    // Sign-extend narrower values
+    if (bytes < 8 && (value >> (8 * bytes - 1)) & 1) {
+      value |= ~0ULL << (8 * bytes);
+    }
+    return static_cast<long long>(value);
+  }
+
+  std::string readString() {
+    size_t size = static_cast<size_t>(readInt());
+    if (!ok || pos + size > data.size()) {
+      ok = false;
+      return "";
+    }
+    std::string value = data.substr(pos, size);
+    pos += size;
+    return value;
+  }
+};
+
+/**
+ * Encode a repository status for the coordinator. Keep in step with
+ * decodeStatus() and with the RepoStatus fields the report uses.
+ *
+ * @param index The repository's index in the coordinator's target list
+ * @param status The repository status
+ * @return The frame payload
+ */
+std::string encodeStatus(size_t index, const RepoStatus &status) {
+  std::string out;
+  frameAppendInt(out, static_cast<long long>(index));
+  for (const std::string *field :
+       {&status.name, &status.type, &status.currentBranch, &status.error,
+        &status.pullError, &status.headOid, &status.upstreamOid,
+        &status.pulledOid, &status.upstreamVersion,
+        &status.requiresMediaWiki}) {
+    frameAppendString(out, *field);
+  }
+  frameAppendString(out, status.path.string());
+  int flags = (status.isRepo ? 1 : 0) | (status.hasUpdates ? 2 : 0) |
+              (status.pulled ? 4 : 0) | (status.hadUncommittedChanges ? 8 : 0) |
+              (status.lockContention ? 16 : 0) |
+              (status.behindCached ? 32 : 0) | (status.incompatible ? 64 : 0) |
+              (status.corrupted ? 128 : 0) |
+              (status.negativeCached ? 256 : 0);
+  frameAppendInt(out, flags);
+  frameAppendInt(out, status.behindBy);
+  // Rates travel in thousandths of a commit per day
+  frameAppendInt(out, std::llround(status.commitsPerDay * 1000), 8);
+  frameAppendInt(out, status.fetchInterval, 8);
+  frameAppendInt(out, status.oldestMissingTime, 8);
+  frameAppendInt(out, status.headCommitTime, 8);
+  frameAppendInt(out, status.incomingFiles);
+  frameAppendInt(out, status.changelogTotal);
+  frameAppendInt(out, static_cast<long long>(status.fetchFailure));
+  frameAppendInt(out, static_cast<long long>(status.changelog.size()));
+  for (const auto &line : status.changelog) {
+    frameAppendString(out, line);
+  }
+  return out;
+}
+
+/**
+ * Decode a repository status sent by a shard worker
+ *
+ * @param payload The frame payload
+ * @param index Receives the repository's index in the target list
+ * @param status Receives the repository status
+ * @return false if the payload is malformed
+ */
+bool decodeStatus(const std::string &payload, size_t &index,
+                  RepoStatus &status) {
+  FrameReader reader{payload};
+  index = static_cast<size_t>(reader.readInt());
+  for (std::string *field :
+       {&status.name, &status.type, &status.currentBranch, &status.error,
+        &status.pullError, &status.headOid, &status.upstreamOid,
+        &status.pulledOid, &status.upstreamVersion,
+        &status.requiresMediaWiki}) {
+    *field = reader.readString();
+  }
+  status.path = reader.readString();
+  int flags = static_cast<int>(reader.readInt());
+  status.isRepo = flags & 1;
+  status.hasUpdates = flags & 2;
+  status.pulled = flags & 4;
+  status.hadUncommittedChanges = flags & 8;
+  status.lockContention = flags & 16;
+  status.behindCached = flags & 32;
+  status.incompatible = flags & 64;
+  status.corrupted = flags & 128;
+  status.negativeCached = flags & 256;
+  status.behindBy = static_cast<int>(reader.readInt());
+  status.commitsPerDay = reader.readInt(8) / 1000.0;
+  status.fetchInterval = reader.readInt(8);
+  status.oldestMissingTime = reader.readInt(8);
+  status.headCommitTime = reader.readInt(8);
+  status.incomingFiles = static_cast<int>(reader.readInt());
+  status.changelogTotal = static_cast<int>(reader.readInt());
+  status.fetchFailure = static_cast<GitFailure>(reader.readInt());
+  long long changelogSize = reader.readInt();
+  for (long long i = 0; i < changelogSize && reader.ok; i++) {
+    status.changelog.push_back(reader.readString());
+  }
+  return reader.ok;
+}
+
+/**
+ * Encode the run-wide counters a shard worker collected
+ *
+ * @return The frame payload
+ */
+std::string encodeTotals() {
+  std::string out;
+  frameAppendInt(out, g_verifiedPacks);
+  frameAppendInt(out, g_verifiedLooseObjects);
+  frameAppendInt(out, g_verifiedBytes, 8);
+  std::lock_guard<std::mutex> lock(g_fetchStatsMutex);
+  frameAppendInt(out, g_fetchStats.hedged);
+  frameAppendInt(out, g_fetchStats.hedgeWins);
+  frameAppendInt(out, static_cast<long long>(g_fetchStats.observedMs.size()));
+  for (size_t i = 0; i < g_fetchStats.observedMs.size(); i++) {
+    frameAppendInt(out, g_fetchStats.observedMs[i], 8);
+    frameAppendInt(out, g_fetchStats.unhedgedMs[i], 8);
+  }
+  return out;
+}
+
+/**
+ * Add a shard worker's counters to this process's
+ *
+ * @param payload The frame payload
+ */
+void mergeTotals(const std::string &payload) {
+  FrameReader reader{payload};
+  g_verifiedPacks += static_cast<int>(reader.readInt());
+  g_verifiedLooseObjects += static_cast<int>(reader.readInt());
+  g_verifiedBytes += reader.readInt(8);
+  std::lock_guard<std::mutex> lock(g_fetchStatsMutex);
+  g_fetchStats.hedged += static_cast<int>(reader.readInt());
+  g_fetchStats.hedgeWins += static_cast<int>(reader.readInt());
+  long long samples = reader.readInt();
+  for (long long i = 0; i < samples && reader.ok; i++) {
+    g_fetchStats.observedMs.push_back(reader.readInt(8));
+    g_fetchStats.unhedgedMs.push_back(reader.readInt(8));
+  }
+}
+
+/**
+ * Write a whole frame to a pipe
+ *
+ * @param fd The pipe
+ * @param type The frame type
+ * @param payload The frame payload
+ * @return false if the pipe was closed
+ */
+bool writeFrame(int fd, char type, const std::string &payload) {
+  std::string frame(1, type);
+  frameAppendInt(frame, static_cast<long long>(payload.size()));
+  frame += payload;
+  size_t sent = 0;
+  while (sent < frame.size()) {
+    ssize_t written = write(fd, frame.data() + sent, frame.size() - sent);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    sent += static_cast<size_t>(written);
+  }
+  return true;
+}
+
+// A running shard worker and what it has sent back so far
+struct ShardWorker {
+  pid_t pid = -1;
+  int fd = -1;
+  std::string buffer;
+  std::vector<size_t> targets;
+  std::vector<bool> received;
+  bool ended = false;
+  // Set for the retry of the one repository a crashed worker was on
+  bool isolated = false;
+};
+
+/**
+ * Fork a worker process that checks the given repositories and streams the
+ * results back over a pipe
+ *
+ * @param targets All repositories of the run
+ * @param worker The shard, with its target indexes set
+ * @param openFds Coordinator pipe ends the child must close
+ * @return false if the worker could not be started
+ */
+bool startShardWorker(const std::vector<RepoTarget> &targets,
+                      ShardWorker &worker, const std::vector<int> &openFds) {
+  // Close-on-exec, or every git the worker starts (and any gc it leaves
+  // running in the background) would hold the pipe open
+  int fds[2];
+  if (!openPipe(fds)) {
+    return false;
+  }
+  std::cout.flush();
+  pid_t pid;
+  {
+    [[maybe_unused]] SpawnLock lock;
+    pid = fork();
+  }
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    for (int fd : openFds) {
+      close(fd);
+    }
+    // The coordinator owns the terminal
+    g_progressDisplay = false;
+    std::vector<RepoTarget> subset;
+    for (size_t index : worker.targets) {
+      subset.push_back(targets[index]);
+    }
+    std::mutex writeMutex;
+    checkRepositories(subset, [&](size_t i, const RepoStatus &status) {
+      std::lock_guard<std::mutex> lock(writeMutex);
+      writeFrame(fds[1], FRAME_RESULT, encodeStatus(worker.targets[i], status));
+    });
+    writeFrame(fds[1], FRAME_TOTALS, encodeTotals());
+    writeFrame(fds[1], FRAME_END, "");
+    std::cout.flush();
+    _exit(0);
+  }
+  close(fds[1]);
+  worker.pid = pid;
+  worker.fd = fds[0];
+  worker.buffer.clear();
+  worker.ended = false;
+  return true;
+}
+
+/**
+ * Check repositories in separate worker processes, one per shard, and
+ * merge their results
+ *
+ * Each worker has its own threads and file descriptors, so limits apply
+ * per shard, and a repository that crashes git or local_mw only takes its
+ * own shard down. When a shard crashes, the first repository it had not
+ * reported yet is retried on its own, and failed only if it crashes that
+ * worker too; the rest of the shard is restarted without it. The other
+ * shards are not affected.
+ *
+ * @param targets The repositories to check
+ * @param shardCount The number of worker processes
+ * @return The repository statuses, in the same order as the targets
+ */
+std::vector<RepoStatus> checkRepositoriesSharded(
+    const std::vector<RepoTarget> &targets, int shardCount) {
+  std::vector<RepoStatus> results(targets.size());
+  std::vector<bool> done(targets.size(), false);
+  std::vector<ShardWorker> workers;
+  for (auto &shardTargets : assignShards(targets, shardCount)) {
+    if (!shardTargets.empty()) {
+      ShardWorker worker;
+      worker.targets = shardTargets;
+      workers.push_back(worker);
+    }
+  }
+
+  auto openFds = [&workers]() {
+    std::vector<int> fds;
+    for (const auto &worker : workers) {
+      if (worker.fd >= 0) {
+        fds.push_back(worker.fd);
+      }
+    }
+    return fds;
+  };
+  auto failShard = [&](ShardWorker &worker, const std::string &error) {
+    for (size_t index : worker.targets) {
+      if (!done[index]) {
+        results[index].name = targets[index].name.empty()
+                                  ? targets[index].path.filename().string()
+                                  : targets[index].name;
+        results[index].type = targets[index].type;
+        results[index].path = targets[index].path;
+        results[index].isRepo = true;
+        results[index].error = error;
+        done[index] = true;
+      }
+    }
+  };
+
+  for (auto &worker : workers) {
+    if (!startShardWorker(targets, worker, openFds())) {
+      failShard(worker, "Could not start shard worker");
+    }
+  }
+
+  while (true) {
+    std::vector<pollfd> pollFds;
+    std::vector<ShardWorker *> polled;
+    for (auto &worker : workers) {
+      if (worker.fd >= 0) {
+        pollFds.push_back({worker.fd, POLLIN, 0});
+        polled.push_back(&worker);
+      }
+    }
+    if (pollFds.empty()) {
+      break;
+    }
+    if (poll(pollFds.data(), pollFds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
       }
+      break;
+    }
 
-      if (userConfirmed) {
-        if (g_verbose) {
-          logVerbose("  [STEP] Performing git pull...");
-        }
-        if (performGitPull(repoPath, status.pullError)) {
-          status.pulled = true;
-          if (g_verbose) {
-            logVerbose("  [SUCCESS] Git pull completed");
+    std::vector<ShardWorker> restarted;
+    for (size_t p = 0; p < pollFds.size(); p++) {
+      if (!(pollFds[p].revents & (POLLIN | POLLHUP | POLLERR))) {
+        continue;
+      }
+      ShardWorker &worker = *polled[p];
+      std::array<char, 65536> chunk;
+      ssize_t received = read(worker.fd, chunk.data(), chunk.size());
+      if (received > 0) {
+        worker.buffer.append(chunk.data(), static_cast<size_t>(received));
+        // Handle every complete frame in the buffer
+        while (worker.buffer.size() >= 5) {
+          FrameReader header{worker.buffer, 1};
+          size_t length = static_cast<size_t>(header.readInt());
+          if (worker.buffer.size() < 5 + length) {
+            break;
           }
-        } else {
-          if (g_verbose) {
-            logVerbose("  [ERROR] Git pull failed: " + status.pullError);
+          char type = worker.buffer[0];
+          std::string payload = worker.buffer.substr(5, length);
+          worker.buffer.erase(0, 5 + length);
+          size_t index = 0;
+          RepoStatus status;
+          if (type == FRAME_RESULT && decodeStatus(payload, index, status) &&
+              index < targets.size()) {
+            results[index] = status;
+            done[index] = true;
+          } else if (type == FRAME_TOTALS) {
+            mergeTotals(payload);
+          } else if (type == FRAME_END) {
+            worker.ended = true;
           }
         }
-      } else {
-        if (g_verbose) {
-          logVerbose("  [INFO] User declined pull");
+        // A worker is done once it says so; its pipe may stay open in
+        // processes it left behind
+        if (!worker.ended) {
+          continue;
         }
-        // Keep hasUpdates true but don't pull
+      } else if (received < 0 && errno == EINTR) {
+        continue;
+      }
+
+      // End of output: reap the worker and decide whether it finished
+      close(worker.fd);
+      worker.fd = -1;
+      int waitStatus = 0;
+      waitpid(worker.pid, &waitStatus, 0);
+      bool clean = worker.ended && WIFEXITED(waitStatus) &&
+                   WEXITSTATUS(waitStatus) == 0;
+      std::vector<size_t> remaining;
+      for (size_t index : worker.targets) {
+        if (!done[index]) {
+          remaining.push_back(index);
+        }
+      }
+      if (clean || remaining.empty()) {
+        continue;
+      }
+      std::string cause =
+          WIFSIGNALED(waitStatus)
+              ? "signal " + std::to_string(WTERMSIG(waitStatus))
+              : "exit status " + std::to_string(WEXITSTATUS(waitStatus));
+      if (worker.isolated) {
+        std::cerr << "Shard worker failed (" << cause << ") again on "
+                  << targets[remaining[0]].path.string() << "\n";
+        failShard(worker, "Shard worker crashed (" + cause + ")");
+        continue;
+      }
+      std::cerr << "Shard worker failed (" << cause << "), retrying "
+                << remaining.size() << " repositories\n";
+      // The first repository it had not reported is the likeliest culprit:
+      // give it a worker of its own so it cannot sink the others again
+      ShardWorker suspect;
+      suspect.targets = {remaining[0]};
+      suspect.isolated = true;
+      restarted.push_back(suspect);
+      if (remaining.size() > 1) {
+        ShardWorker rest;
+        rest.targets.assign(remaining.begin() + 1, remaining.end());
+        restarted.push_back(rest);
       }
     }
-  } else if (status.behindBy < 0) {
-    status.error = "No tracking branch or error checking";
-    if (g_verbose) {
-      logVerbose("  [WARNING] No tracking branch or error checking");
-    }
-  } else {
-    if (g_verbose) {
-      logVerbose("  [RESULT] Up to date");
+
+    // Started after polling, as adding workers moves the ones polled
+    for (auto &worker : restarted) {
+      workers.push_back(worker);
+      if (!startShardWorker(targets, workers.back(), openFds())) {
+        failShard(workers.back(), "Could not start shard worker");
+      }
     }
   }
 
-  return status;
+  // Workers saved their state; pick up what they learned
+  {
+    std::lock_guard<std::mutex> lock(g_stateMutex);
+    g_stateTables.clear();
+    g_stateBaselines.clear();
+  }
+  return results;
 }
 
 /**
- * Count the number of directories in a given path
+ * Print one timestamped log line per checked repository (thread-safe)
  *
- * @param dirPath The directory path to scan
- * @return The count of directories
+ * @param results The vector of repository statuses
  */
-int countDirectories(const fs::path &dirPath) {
-  int count = 0;
-  if (fs::exists(dirPath) && fs::is_directory(dirPath)) {
-    for (const auto &entry : fs::directory_iterator(dirPath)) {
-      if (entry.is_directory()) {
-        count++;
-      }
-    }
+void logDaemonResults(const std::vector<RepoStatus> &results) {
+  std::lock_guard<std::mutex> lock(g_coutMutex);
+  std::string timestamp = currentTimestamp();
+  for (const auto &status : results) {
+    std::cout << "[" << timestamp << "] " << status.name << " ("
+              << status.type << "): " << describeStatus(status) << "\n";
   }
-  return count;
+  std::cout.flush();
 }
 
-struct Statistics {
-  int upToDate = 0;
-  int hasUpdates = 0;
-  int errors = 0;
-};
+volatile std::sig_atomic_t g_stopDaemon = 0;
 
 /**
- * Calculate statistics from repository statuses
+ * Signal handler asking the daemon loop to exit
  *
- * @param results The vector of repository statuses
- * @return The calculated statistics
+ * @param signal The received signal
  */
-Statistics calculateStats(const std::vector<RepoStatus> &results) {
-  Statistics stats;
-  for (const auto &status : results) {
-    if (!status.isRepo || !status.error.empty()) {
-      stats.errors++;
-    } else if (status.hasUpdates) {
-      stats.hasUpdates++;
+void handleDaemonSignal(int) { g_stopDaemon = 1; }
+
+/**
+ * Decode a percent-encoded URL component ("+" is a space)
+ *
+ * @param text The encoded text
+ * @return The decoded text
+ */
+std::string urlDecode(const std::string &text) {
+  std::string decoded;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] == '+') {
+      decoded += ' ';
+    } else if (text[i] == '%' && i + 2 < text.size() &&
+               std::isxdigit(static_cast<unsigned char>(text[i + 1])) &&
+               std::isxdigit(static_cast<unsigned char>(text[i + 2]))) {
+      decoded +=
+          static_cast<char>(std::stoi(text.substr(i + 1, 2), nullptr, 16));
+      i += 2;
     } else {
-      stats.upToDate++;
+      decoded += text[i];
     }
   }
-  return stats;
+  return decoded;
 }
 
 /**
- * Print verbose directory header
+ * Parse a change notification
  *
- * @param dirType The type of directory (extensions, skins)
- * @param dirPath The directory path
+ * Two forms are accepted: a plain line "<repo> [ref]", or an HTTP request
+ * (for webhook senders) carrying repo= and ref= in the query string or in a
+ * form-encoded body, or "<repo> [ref]" as the body. <repo> is a repository
+ * name, a path, or a remote URL.
+ *
+ * @param request The raw request
+ * @param target Set to the named repository
+ * @param ref Set to the named ref (may be empty)
+ * @param isHttp Set to true if the request was an HTTP request
+ * @return true if a repository was named
  */
-void printVerboseDirectoryHeader(const std::string &dirType,
-                                 const fs::path &dirPath) {
-  if (!g_verbose)
-    return;
-  std::cout << "\n" << std::string(80, '=') << "\n";
-  std::cout << "Scanning " << dirType << " directory: " << dirPath.string()
-            << "\n";
-  std::cout << std::string(80, '=') << "\n";
+bool parseNotification(const std::string &request, std::string &target,
+                       std::string &ref, bool &isHttp) {
+  std::string firstLine = request.substr(0, request.find('\n'));
+  if (!firstLine.empty() && firstLine.back() == '\r') {
+    firstLine.pop_back();
+  }
+  isHttp = firstLine.compare(0, 5, "POST ") == 0 ||
+           firstLine.compare(0, 4, "GET ") == 0;
+
+  std::string payload = firstLine;
+  if (isHttp) {
+    std::string requestTarget = firstLine.substr(firstLine.find(' ') + 1);
+    requestTarget = requestTarget.substr(0, requestTarget.find(' '));
+    size_t query = requestTarget.find('?');
+    size_t bodyStart = request.find("\r\n\r\n");
+    std::string body =
+        bodyStart == std::string::npos ? "" : request.substr(bodyStart + 4);
+    if (query != std::string::npos) {
+      payload = requestTarget.substr(query + 1);
+    } else {
+      payload = body.substr(0, body.find('\n'));
+    }
+    if (payload.find('=') != std::string::npos) {
+      std::istringstream fields(payload);
+      std::string field;
+      while (std::getline(fields, field, '&')) {
+        size_t equals = field.find('=');
+        std::string key = field.substr(0, equals);
+        std::string value = equals == std::string::npos
+                                ? ""
+                                : urlDecode(field.substr(equals + 1));
+        if (key == "repo") {
+          target = value;
+        } else if (key == "ref") {
+          ref = value;
+        }
+      }
+      return !target.empty();
+    }
+  }
+
+  std::istringstream words(payload);
+  words >> target >> ref;
+  return !target.empty();
 }
 
 /**
- * Scan a directory for repositories
+ * Check whether a repository is affected by a change notification
  *
- * @param dirPath The directory path to scan
- * @param type The type of repositories (extension, skin)
- * @return A vector of repository statuses
+ * @param target The repository target
+ * @param basePath The MediaWiki installation path
+ * @param name The repository named in the notification
+ * @param ref The ref named in the notification (may be empty)
+ * @return true if the checkout should be refreshed
  */
-std::vector<RepoStatus> scanDirectory(const fs::path &dirPath,
-                                      const std::string &type) {
-  std::vector<RepoStatus> results;
+bool targetMatchesNotification(const RepoTarget &target,
+                               const fs::path &basePath,
+                               const std::string &name,
+                               const std::string &ref) {
+  std::error_code ec;
+  bool matches = name == target.name ||
+                 name == target.path.filename().string() ||
+                 fs::equivalent(name, target.path, ec) ||
+                 fs::equivalent(basePath / name, target.path, ec);
+  if (!matches) {
+    std::string url = readRemoteUrl(target.path);
+    matches = !url.empty() &&
+              normalizeRemoteUrl(url) == normalizeRemoteUrl(name);
+  }
+  if (!matches || ref.empty()) {
+    return matches;
+  }
 
-  if (!fs::exists(dirPath) || !fs::is_directory(dirPath)) {
-    return results;
+  // Only a branch update can change what a checkout is behind
+  std::string branch = ref;
+  const std::string headsPrefix = "refs/heads/";
+  if (branch.compare(0, headsPrefix.size(), headsPrefix) == 0) {
+    branch = branch.substr(headsPrefix.size());
+  } else if (branch.compare(0, 5, "refs/") == 0) {
+    return false;
   }
+  std::string currentBranch = readHeadBranch(target.path);
+  return currentBranch.empty() || currentBranch == branch;
+}
 
-  const unsigned int maxThreads =
-      std::max(1u, std::thread::hardware_concurrency());
-  std::vector<std::future<RepoStatus>> futures;
-  futures.reserve(32);
+/**
+ * Read a notification request from a client connection
+ *
+ * Reads until the end of the first line for plain requests, or until the
+ * end of the body for HTTP requests.
+ *
+ * @param clientFd The connected client socket
+ * @return The raw request (possibly truncated)
+ */
+std::string readNotificationRequest(int clientFd) {
+  timeval timeout{2, 0};
+  setsockopt(clientFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-  for (const auto &entry : fs::directory_iterator(dirPath)) {
-    if (!entry.is_directory()) {
-      continue;
+  std::string request;
+  std::array<char, 4096> buffer;
+  while (request.size() < MAX_REQUEST_BYTES) {
+    ssize_t received = recv(clientFd, buffer.data(), buffer.size(), 0);
+    if (received <= 0) {
+      break;
     }
+    request.append(buffer.data(), static_cast<size_t>(received));
 
-    futures.emplace_back(
-        std::async(std::launch::async, [path = entry.path(), type]() {
-          return checkRepository(path, type);
-        }));
+    bool isHttp = request.compare(0, 5, "POST ") == 0 ||
+                  request.compare(0, 4, "GET ") == 0;
+    if (!isHttp) {
+      if (request.find('\n') != std::string::npos) {
+        break;
+      }
+      continue;
+    }
+    size_t headerEnd = request.find("\r\n\r\n");
+    if (headerEnd == std::string::npos) {
+      continue;
+    }
+    size_t contentLength = 0;
+    std::string lowerHeaders = request.substr(0, headerEnd);
+    std::transform(lowerHeaders.begin(), lowerHeaders.end(),
+                   lowerHeaders.begin(), ::tolower);
+    size_t lengthPos = lowerHeaders.find("content-length:");
+    if (lengthPos != std::string::npos) {
+      contentLength = std::strtoul(
+          lowerHeaders.c_str() + lengthPos + strlen("content-length:"),
+          nullptr, 10);
+    }
+    if (request.size() >= headerEnd + 4 + contentLength) {
+      break;
+    }
+  }
+  return request;
+}
 
-    if (futures.size() >= maxThreads) {
-      results.push_back(futures.front().get());
-      futures.erase(futures.begin());
+/**
+ * Send a reply to a notification client
+ *
+ * @param clientFd The connected client socket
+ * @param isHttp Whether to wrap the reply in an HTTP response
+ * @param ok Whether the notification was accepted
+ * @param message The reply text
+ */
+void sendNotificationReply(int clientFd, bool isHttp, bool ok,
+                           const std::string &message) {
+  std::string reply = (ok ? "OK " : "ERROR ") + message + "\n";
+  if (isHttp) {
+    std::string statusLine =
+        ok ? "HTTP/1.0 202 Accepted" : "HTTP/1.0 400 Bad Request";
+    reply = statusLine + "\r\nContent-Type: text/plain\r\nContent-Length: " +
+            std::to_string(reply.size()) + "\r\n\r\n" + reply;
+  }
+  const char *data = reply.data();
+  size_t remaining = reply.size();
+  while (remaining > 0) {
+    ssize_t sent = send(clientFd, data, remaining, MSG_NOSIGNAL);
+    if (sent <= 0) {
+      break;
     }
+    data += sent;
+    remaining -= static_cast<size_t>(sent);
   }
+}
 
-  for (auto &future : futures) {
-    results.push_back(future.get());
+/**
+ * Create the daemon's Unix socket and start listening on it
+ *
+ * @param socketPath The socket path (an existing socket file is replaced)
+ * @return The listening socket, or -1 on error
+ */
+int openListenSocket(const std::string &socketPath) {
+  sockaddr_un address{};
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Error: Socket path is too long: " << socketPath << "\n";
+    return -1;
   }
+  address.sun_family = AF_UNIX;
+  std::strncpy(address.sun_path, socketPath.c_str(),
+               sizeof(address.sun_path) - 1);
 
-  return results;
+  int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenFd < 0) {
+    std::cerr << "Error: Could not create socket: " << std::strerror(errno)
+              << "\n";
+    return -1;
+  }
+  unlink(socketPath.c_str());
+  if (bind(listenFd, reinterpret_cast<sockaddr *>(&address),
+           sizeof(address)) != 0 ||
+      listen(listenFd, 16) != 0) {
+    std::cerr << "Error: Could not listen on " << socketPath << ": "
+              << std::strerror(errno) << "\n";
+    close(listenFd);
+    return -1;
+  }
+  chmod(socketPath.c_str(), 0600);
+  return listenFd;
 }
 
 /**
- * Print results in a formatted table
+ * Send a change notification to a running daemon and print its reply
  *
- * @param results The vector of repository statuses
- * @param reportStream Optional output file stream for the report
+ * @param socketPath The daemon's socket path
+ * @param target The repository name, path or remote URL that changed
+ * @param ref The ref that changed (may be empty)
+ * @return 0 if the daemon accepted the notification, 1 otherwise
  */
-void printResults(const std::vector<RepoStatus> &results,
-                  std::ofstream *reportStream = nullptr) {
-  if (results.empty()) {
-    return;
+int sendNotification(const std::string &socketPath, const std::string &target,
+                     const std::string &ref) {
+  sockaddr_un address{};
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Error: Socket path is too long: " << socketPath << "\n";
+    return 1;
   }
+  address.sun_family = AF_UNIX;
+  std::strncpy(address.sun_path, socketPath.c_str(),
+               sizeof(address.sun_path) - 1);
 
-  std::ostringstream oss;
-  oss << "\n" << std::string(100, '=') << "\n";
-  oss << std::left << std::setw(30) << "Name" << std::setw(12) << "Type"
-      << std::setw(15) << "Branch" << std::setw(10) << "Behind" << std::setw(14)
-      << "Uncommitted"
-      << "Status\n";
-  oss << std::string(100, '-') << "\n";
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&address),
+                        sizeof(address)) != 0) {
+    std::cerr << "Error: Could not connect to " << socketPath << ": "
+              << std::strerror(errno) << "\n";
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
 
-  for (const auto &status : results) {
-    oss << std::left << std::setw(30) << status.name << std::setw(12)
-        << status.type << std::setw(15)
-        << (status.currentBranch.empty() ? "N/A" : status.currentBranch);
+  std::signal(SIGPIPE, SIG_IGN);
+  std::string request = target + (ref.empty() ? "" : " " + ref) + "\n";
+  if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) < 0) {
+    std::cerr << "Error: Could not send notification\n";
+    close(fd);
+    return 1;
+  }
+  shutdown(fd, SHUT_WR);
 
-    if (!status.isRepo) {
-      oss << std::setw(10) << "N/A" << std::setw(14) << "N/A"
-          << "⚠️  Not a git repo\n";
-    } else if (!status.error.empty()) {
-      oss << std::setw(10) << "N/A" << std::setw(14) << "N/A"
-          << "⚠️  " << status.error << "\n";
-    } else if (status.pulled) {
-      oss << std::setw(10) << "0" << std::setw(14)
-          << (status.hadUncommittedChanges ? "Yes" : "No");
-      if (status.hadUncommittedChanges) {
-        oss << "✅ Pulled (⚠️  had uncommitted changes)\n";
-      } else {
-        oss << "✅ Pulled and up to date\n";
-      }
-    } else if (!status.pullError.empty()) {
-      oss << std::setw(10) << status.behindBy << std::setw(14)
-          << (status.hadUncommittedChanges ? "Yes" : "No")
-          << "❌ Pull failed: " << status.pullError << "\n";
-    } else if (status.hasUpdates) {
-      oss << std::setw(10) << status.behindBy << std::setw(14)
-          << (status.hadUncommittedChanges ? "Yes" : "No")
-          << "🔴 Updates available\n";
-    } else {
-      oss << std::setw(10) << "0" << std::setw(14)
-          << (status.hadUncommittedChanges ? "Yes" : "No") << "✅ Up to date\n";
-    }
+  std::string reply;
+  std::array<char, 256> buffer;
+  ssize_t received;
+  while ((received = recv(fd, buffer.data(), buffer.size(), 0)) > 0) {
+    reply.append(buffer.data(), static_cast<size_t>(received));
   }
+  close(fd);
 
-  oss << std::string(100, '=') << "\n";
-  writeOutput(oss.str(), reportStream);
+  std::cout << reply;
+  return reply.compare(0, 3, "OK ") == 0 ? 0 : 1;
 }
 
 /**
- * Print results section with fallback message
+ * Run as a daemon: sweep every repository at a fixed interval and, alongside
+ * the sweeps, refresh only the checkouts named by change notifications
  *
- * @param title The section title
- * @param results The vector of repository statuses
- * @param reportStream Optional output file stream for the report
+ * @param basePath The MediaWiki installation path
+ * @return Exit code
  */
-void printResultsSection(const std::string &title,
-                         const std::vector<RepoStatus> &results,
-                         std::ofstream *reportStream = nullptr) {
-  std::ostringstream oss;
-  oss << "\n" << title << ":\n";
-  writeOutput(oss.str(), reportStream);
+int runDaemon(const fs::path &basePath) {
+  int listenFd = -1;
+  if (!g_listenSocket.empty()) {
+    listenFd = openListenSocket(g_listenSocket);
+    if (listenFd < 0) {
+      return 1;
+    }
+    std::cout << "Listening for change notifications on " << g_listenSocket
+              << "\n";
+  }
 
-  if (!results.empty()) {
-    printResults(results, reportStream);
-  } else {
-    std::ostringstream msg;
-    if (title == "EXTENSIONS") {
-      msg << "No extensions found or extensions directory doesn't exist.\n";
-    } else if (title == "SKINS") {
-      msg << "No skins found or skins directory doesn't exist.\n";
+  std::signal(SIGINT, handleDaemonSignal);
+  std::signal(SIGTERM, handleDaemonSignal);
+  std::signal(SIGPIPE, SIG_IGN);
+
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point nextSweep = Clock::now();
+  std::vector<RepoTarget> targets;
+  // With --adaptive: latest status and next fetch time of every repository
+  std::map<std::string, RepoStatus> lastStatus;
+  std::map<std::string, Clock::time_point> nextFetch;
+
+  // Guards targets, lastStatus and nextFetch, which the notification
+  // threads share with the sweeps
+  std::mutex scheduleMutex;
+
+  // Record checked repositories and reschedule them from learned rates
+  auto reschedule = [&](const std::vector<RepoStatus> &checked) {
+    std::lock_guard<std::mutex> scheduleLock(scheduleMutex);
+    for (const auto &status : checked) {
+      lastStatus[status.path.string()] = status;
     }
-    writeOutput(msg.str(), reportStream);
+    std::vector<RepoStatus> all;
+    for (const auto &entry : lastStatus) {
+      all.push_back(entry.second);
+    }
+    assignFetchIntervals(all);
+    for (const auto &status : all) {
+      lastStatus[status.path.string()].fetchInterval = status.fetchInterval;
+    }
+    std::lock_guard<std::mutex> lock(g_coutMutex);
+    for (const auto &status : checked) {
+      int interval = lastStatus[status.path.string()].fetchInterval;
+      if (interval <= 0) {
+        interval = MAX_FETCH_INTERVAL;
+      }
+      nextFetch[status.path.string()] =
+          Clock::now() + std::chrono::seconds(interval);
+      std::cout << "[" << currentTimestamp() << "] " << status.name
+                << ": next fetch in " << formatDuration(interval) << "\n";
+    }
+    std::cout.flush();
+  };
+
+  // Notifications are taken and checked on threads of their own, so a push
+  // is re-checked right away even in the middle of a sweep. Checkouts named
+  // again while they are still queued are checked once.
+  std::mutex queueMutex;
+  std::condition_variable queueReady;
+  std::map<std::string, RepoTarget> queued;
+  std::thread listener, notifier;
+  if (listenFd >= 0) {
+    listener = std::thread([&]() {
+      while (!g_stopDaemon) {
+        pollfd pfd{listenFd, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) <= 0 || !(pfd.revents & POLLIN)) {
+          continue;
+        }
+        int clientFd = accept(listenFd, nullptr, nullptr);
+        if (clientFd < 0) {
+          continue;
+        }
+
+        std::string name, ref;
+        bool isHttp = false;
+        std::string request = readNotificationRequest(clientFd);
+        if (!parseNotification(request, name, ref, isHttp)) {
+          sendNotificationReply(clientFd, isHttp, false,
+                                "expected: <repo|path|url> [ref]");
+          close(clientFd);
+          continue;
+        }
+
+        std::vector<RepoTarget> affected;
+        {
+          std::lock_guard<std::mutex> lock(scheduleMutex);
+          for (const auto &target : targets) {
+            if (targetMatchesNotification(target, basePath, name, ref)) {
+              affected.push_back(target);
+            }
+          }
+        }
+        sendNotificationReply(clientFd, isHttp, true,
+                              std::to_string(affected.size()) +
+                                  " checkout(s) queued");
+        close(clientFd);
+
+        {
+          std::lock_guard<std::mutex> lock(g_coutMutex);
+          std::cout << "[" << currentTimestamp() << "] Notification for "
+                    << name << (ref.empty() ? "" : " " + ref) << ": "
+                    << affected.size() << " checkout(s) affected\n";
+        }
+        if (!affected.empty()) {
+          std::lock_guard<std::mutex> lock(queueMutex);
+          for (const auto &target : affected) {
+            queued.emplace(target.path.string(), target);
+          }
+          queueReady.notify_one();
+        }
+      }
+    });
+    notifier = std::thread([&]() {
+      while (!g_stopDaemon) {
+        std::vector<RepoTarget> batch;
+        {
+          std::unique_lock<std::mutex> lock(queueMutex);
+          // Wake up at least once a second so signals are noticed promptly
+          queueReady.wait_for(lock, std::chrono::seconds(1),
+                              [&]() { return !queued.empty(); });
+          for (const auto &entry : queued) {
+            batch.push_back(entry.second);
+          }
+          queued.clear();
+        }
+        if (batch.empty()) {
+          continue;
+        }
+        std::vector<RepoStatus> results = checkRepositories(batch);
+        logDaemonResults(results);
+        if (g_adaptive) {
+          reschedule(results);
+        }
+      }
+    });
+  }
+
+  while (!g_stopDaemon) {
+    if (Clock::now() >= nextSweep) {
+      std::vector<RepoTarget> found = collectTargets(basePath, false);
+      nextSweep = Clock::now() + std::chrono::seconds(g_sweepInterval);
+      {
+        std::lock_guard<std::mutex> lock(scheduleMutex);
+        targets = found;
+        // Newly discovered repositories are due straight away
+        for (const auto &target : targets) {
+          nextFetch.emplace(target.path.string(), Clock::now());
+        }
+      }
+      if (!g_adaptive) {
+        {
+          std::lock_guard<std::mutex> lock(g_coutMutex);
+          std::cout << "[" << currentTimestamp() << "] Full sweep of "
+                    << found.size() << " repositories\n";
+        }
+        logDaemonResults(checkRepositories(found));
+        continue;
+      }
+    }
+
+    if (g_adaptive) {
+      std::vector<RepoTarget> due;
+      {
+        std::lock_guard<std::mutex> lock(scheduleMutex);
+        for (const auto &target : targets) {
+          auto it = nextFetch.find(target.path.string());
+          if (it != nextFetch.end() && it->second <= Clock::now()) {
+            due.push_back(target);
+          }
+        }
+      }
+      if (!due.empty()) {
+        std::vector<RepoStatus> results = checkRepositories(due);
+        logDaemonResults(results);
+        reschedule(results);
+        continue;
+      }
+    }
+
+    // Wake up at least once a second so signals are noticed promptly
+    auto untilSweep = std::chrono::duration_cast<std::chrono::milliseconds>(
+        nextSweep - Clock::now());
+    std::this_thread::sleep_for(std::chrono::milliseconds(
+        std::max<long long>(0, std::min<long long>(1000, untilSweep.count()))));
+  }
+
+  if (listener.joinable()) {
+    listener.join();
   }
+  if (notifier.joinable()) {
+    notifier.join();
+  }
+  if (listenFd >= 0) {
+    close(listenFd);
+    unlink(g_listenSocket.c_str());
+  }
+  std::cout << "Daemon stopped\n";
+  return 0;
 }
 
 /**
- * Update a specific extension or skin
+ * Run the post-update health command in the installation directory
  *
- * @param basePath The base MediaWiki installation path
- * @param type The type of repository (core, extension, skin)
- * @param name The name of the extension or skin (empty for core)
- * @return 0 on success, 1 on error
+ * @param basePath The MediaWiki installation path
+ * @param output Receives the command's combined output
+ * @return true if the command exited with status 0
  */
-int updateSingleRepo(const fs::path &basePath, const std::string &type,
-                     const std::string &name) {
-  fs::path repoPath;
-  std::string displayName;
-
-  if (type == "core") {
-    repoPath = basePath;
-    displayName = "MediaWiki core";
-  } else if (type == "extension") {
-    repoPath = basePath / "extensions" / name;
-    displayName = "extension '" + name + "'";
-  } else if (type == "skin") {
-    repoPath = basePath / "skins" / name;
-    displayName = "skin '" + name + "'";
-  } else {
-    std::cerr << "Error: Invalid type '" << type
-              << "'. Must be 'core', 'extension', or 'skin'.\n";
-    return 1;
-  }
-
-  if (!fs::exists(repoPath)) {
-    std::cerr << "Error: " << displayName
-              << " not found at: " << repoPath.string() << "\n";
-    return 1;
+bool runHealthCheck(const fs::path &basePath, std::string &output) {
+  std::string cmd =
+      "cd \"" + basePath.string() + "\" && (" + g_healthCommand + ") 2>&1";
+  if (g_verbose) {
+    logVerbose("  [CMD] " + cmd);
   }
-
-  if (!fs::is_directory(repoPath)) {
-    std::cerr << "Error: Path exists but is not a directory: "
-              << repoPath.string() << "\n";
-    return 1;
+  output.clear();
+  FILE *pipe = openCommand(cmd);
+  if (!pipe) {
+    return false;
   }
-
-  std::cout << "Checking " << displayName << " at: " << repoPath.string()
-            << "\n";
-
-  RepoStatus status = checkRepository(repoPath, type);
-
-  if (!status.isRepo) {
-    std::cerr << "Error: Not a git repository\n";
-    return 1;
+  std::array<char, 4096> buffer;
+  size_t bytesRead;
+  while ((bytesRead = fread(buffer.data(), 1, buffer.size(), pipe)) > 0) {
+    output.append(buffer.data(), bytesRead);
   }
+  int waitStatus = pclose(pipe);
+  return WIFEXITED(waitStatus) && WEXITSTATUS(waitStatus) == 0;
+}
 
-  if (!status.error.empty()) {
-    std::cerr << "Error: " << status.error << "\n";
-    return 1;
-  }
+/**
+ * Check and update core first, then everything else in waves, stopping
+ * the rollout at the first failure
+ *
+ * Core must pull cleanly and pass the health command before any extension
+ * or skin is pulled, and compatibility gating then sees the new core
+ * version. Each later wave is checked in parallel and followed by the
+ * health command if it pulled anything. Once a wave fails, the remaining
+ * repositories are still checked but not pulled.
+ *
+ * @param basePath The MediaWiki installation path
+ * @param targets The repositories, core first
+ * @param rollout Receives one line per stage for the report
+ * @return The repository statuses, in the same order as the targets
+ */
+std::vector<RepoStatus> runStagedRollout(const fs::path &basePath,
+                                         const std::vector<RepoTarget> &targets,
+                                         std::vector<std::string> &rollout) {
+  auto check = [](const std::vector<RepoTarget> &wave) {
+    return g_shards > 1 ? checkRepositoriesSharded(wave, g_shards)
+                        : checkRepositories(wave);
+  };
+  std::vector<RepoStatus> results;
+  bool stopped = false;
+  const bool pullsEnabled = !g_reportOnly;
 
-  std::cout << "\nRepository Status:\n";
-  std::cout << "  Branch: " << status.currentBranch << "\n";
-  std::cout << "  Uncommitted changes: "
-            << (status.hadUncommittedChanges ? "Yes" : "No") << "\n";
-  std::cout << "  Commits behind: "
-            << (status.behindBy >= 0 ? std::to_string(status.behindBy)
-                                     : "Unknown")
-            << "\n";
+  // Returns a reason to stop, or an empty string if the stage is healthy
+  auto assess = [&](const std::vector<RepoStatus> &stage) {
+    int pulled = 0;
+    for (const auto &status : stage) {
+      // Plain directories and known-bad checkouts were never going to be
+      // pulled, so they say nothing about the rollout
+      if (!status.isRepo || status.negativeCached) {
+        continue;
+      }
+      // A repository whose fetch failed or was locked out is in an unknown
+      // state, which is no safer to build on than a failed pull
+      if (status.lockContention) {
+        return status.name + " is locked by another git process";
+      }
+      if (status.fetchFailure != GitFailure::None) {
+        return status.name + " could not be fetched: " +
+               describeFailure(status.fetchFailure);
+      }
+      if (!status.pullError.empty()) {
+        return status.name + " failed to pull";
+      }
+      pulled += status.pulled ? 1 : 0;
+    }
+    std::string output;
+    if (pulled == 0 || g_healthCommand.empty()) {
+      return std::string();
+    }
+    auto started = std::chrono::steady_clock::now();
+    bool healthy = runHealthCheck(basePath, output);
+    recordPhase(basePath, PHASE_HEALTH,
+                std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - started)
+                    .count());
+    saveStateTables();
+    if (!healthy) {
+      std::string firstLine = output.substr(0, output.find('\n'));
+      return "health check failed" +
+             (firstLine.empty() ? std::string() : ": " + firstLine);
+    }
+    return std::string();
+  };
 
-  if (status.behindBy <= 0) {
-    std::cout << "\n✅ Already up to date!\n";
-    return 0;
+  std::vector<RepoTarget> rest;
+  for (const auto &target : targets) {
+    if (target.type == "core") {
+      std::vector<RepoStatus> stage = check({target});
+      results.insert(results.end(), stage.begin(), stage.end());
+      std::string problem = pullsEnabled ? assess(stage) : "";
+      if (!problem.empty()) {
+        rollout.push_back("Core: " + problem + "; extensions and skins "
+                                               "were not pulled");
+        stopped = true;
+      } else {
+        std::string outcome = "nothing to pull";
+        if (stage[0].pulled) {
+          outcome = g_healthCommand.empty() ? "pulled" : "pulled and healthy";
+        }
+        rollout.push_back("Core: " + outcome);
+        // Gate extension updates on the version core is now at
+        g_coreVersion = readCoreVersion(basePath);
+      }
+    } else {
+      rest.push_back(target);
+    }
   }
 
-  // Prompt user
-  std::ostringstream prompt;
-  prompt << "\nPull " << status.behindBy << " commit"
-         << (status.behindBy > 1 ? "s" : "") << "?";
-  if (status.hadUncommittedChanges) {
-    prompt << "\n  ⚠️  WARNING: Repository has uncommitted changes!";
+  for (size_t start = 0, wave = 1; start < rest.size();
+       start += static_cast<size_t>(g_waveSize), wave++) {
+    std::vector<RepoTarget> waveTargets(
+        rest.begin() + start,
+        rest.begin() + std::min(rest.size(),
+                                start + static_cast<size_t>(g_waveSize)));
+    if (stopped) {
+      g_reportOnly = true;
+    }
+    std::vector<RepoStatus> stage = check(waveTargets);
+    results.insert(results.end(), stage.begin(), stage.end());
+    if (stopped || !pullsEnabled) {
+      continue;
+    }
+    std::string label = "Wave " + std::to_string(wave) + " (" +
+                        std::to_string(waveTargets.size()) + " repositories)";
+    std::string problem = assess(stage);
+    if (!problem.empty()) {
+      rollout.push_back(label + ": " + problem + "; rollout stopped");
+      stopped = true;
+    } else {
+      int pulled = 0;
+      for (const auto &status : stage) {
+        pulled += status.pulled ? 1 : 0;
+      }
+      rollout.push_back(label + ": " + std::to_string(pulled) + " pulled" +
+                        (pulled > 0 && !g_healthCommand.empty()
+                             ? ", healthy"
+                             : ""));
+    }
   }
-  prompt << "\n  ";
-
-  bool confirmed = g_autoYes || promptForConfirmation(prompt.str());
+  g_reportOnly = !pullsEnabled;
+  return results;
+}
 
-  if (!confirmed) {
-    std::cout << "Update cancelled.\n";
-    return 0;
+/**
+ * Parse a command-line count strictly: digits only, at least 1 and within
+ * the range of an int
+ *
+ * @param text The argument
+ * @param value Receives the count
+ * @return false if the argument is not such a count
+ */
+bool parseCount(const std::string &text, int &value) {
+  if (text.empty() ||
+      text.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
   }
-
-  std::cout << "Pulling updates...\n";
-  std::string pullError;
-  if (performGitPull(repoPath, pullError)) {
-    std::cout << "\n✅ Successfully updated!\n";
-    return 0;
-  } else {
-    std::cerr << "\n❌ Pull failed:\n" << pullError << "\n";
-    return 1;
+  errno = 0;
+  long parsed = std::strtol(text.c_str(), nullptr, 10);
+  if (errno == ERANGE || parsed < 1 || parsed > INT_MAX) {
+    return false;
   }
+  value = static_cast<int>(parsed);
+  return true;
 }
 
 /**
@@ -681,6 +7280,10 @@ int main(int argc, char *argv[]) {
     } else if (arg == "--report-only") {
       g_reportOnly = true;
       std::cout << "Report-only mode enabled (no automatic pulls)\n";
+    } else if (arg == "--read-only") {
+      g_readOnly = true;
+      g_reportOnly = true;
+      std::cout << "Read-only mode enabled (no pulls, no index writes)\n";
     } else if (arg == "--yes" || arg == "-y") {
       g_autoYes = true;
       std::cout << "Auto-yes mode enabled (no prompts)\n";
@@ -691,6 +7294,27 @@ int main(int argc, char *argv[]) {
       }
       g_reportFile = argv[++i];
       std::cout << "Report will be saved to: " << g_reportFile << "\n";
+    } else if (arg == "--metrics-file") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --metrics-file requires a filename argument\n";
+        return 1;
+      }
+      g_metricsFile = argv[++i];
+    } else if (arg == "--changelog") {
+      g_changelogLimit = 10;
+      std::string next = (i + 1 < argc) ? argv[i + 1] : "";
+      if (!next.empty() &&
+          next.find_first_not_of("0123456789") == std::string::npos) {
+        errno = 0;
+        long limit = std::strtol(next.c_str(), nullptr, 10);
+        if (errno == ERANGE || limit < 1 || limit > INT_MAX) {
+          std::cerr << "Error: --changelog N must be between 1 and "
+                    << INT_MAX << "\n";
+          return 1;
+        }
+        g_changelogLimit = static_cast<int>(limit);
+        i++;
+      }
     } else if (arg == "--update") {
       if (i + 1 >= argc) {
         std::cerr << "Error: --update requires TYPE argument\n";
@@ -710,6 +7334,198 @@ int main(int argc, char *argv[]) {
       } else {
         g_updateName = argv[++i];
       }
+    } else if (arg == "--nested") {
+      g_nested = true;
+    } else if (arg == "--scan-root") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --scan-root requires a directory argument\n";
+        return 1;
+      }
+      g_nested = true;
+      g_scanRoots.push_back(argv[++i]);
+    } else if (arg == "--daemon") {
+      g_daemon = true;
+    } else if (arg == "--listen") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --listen requires a socket path argument\n";
+        return 1;
+      }
+      g_listenSocket = argv[++i];
+    } else if (arg == "--sweep-interval") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --sweep-interval requires a number of seconds\n";
+        return 1;
+      }
+      if (!parseCount(argv[++i], g_sweepInterval)) {
+        std::cerr << "Error: --sweep-interval N must be between 1 and "
+                  << INT_MAX << "\n";
+        return 1;
+      }
+    } else if (arg == "--adaptive") {
+      g_adaptive = true;
+    } else if (arg == "--fetch-budget") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --fetch-budget requires a number of fetches\n";
+        return 1;
+      }
+      if (!parseCount(argv[++i], g_fetchBudget)) {
+        std::cerr << "Error: --fetch-budget N must be between 1 and " << INT_MAX
+                  << "\n";
+        return 1;
+      }
+    } else if (arg == "--apply-sparse") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --apply-sparse requires a profile file\n";
+        return 1;
+      }
+      g_sparseProfile = argv[++i];
+    } else if (arg == "--migrate-remotes") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --migrate-remotes requires a rules file\n";
+        return 1;
+      }
+      g_migrationRules = argv[++i];
+    } else if (arg == "--replicate-to") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --replicate-to requires an installation path\n";
+        return 1;
+      }
+      g_replicaPaths.push_back(argv[++i]);
+    } else if (arg == "--replicate-hardlinks") {
+      g_replicateHardlinks = true;
+    } else if (arg == "--shards") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --shards requires a number of workers\n";
+        return 1;
+      }
+      if (!parseCount(argv[++i], g_shards)) {
+        std::cerr << "Error: --shards N must be between 1 and " << INT_MAX
+                  << "\n";
+        return 1;
+      }
+    } else if (arg == "--columns") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --columns requires a list of columns\n";
+        return 1;
+      }
+      std::istringstream list(argv[++i]);
+      std::string column;
+      g_columns.clear();
+      while (std::getline(list, column, ',')) {
+        if (column != "name" && column != "type" && column != "branch" &&
+            column != "behind" && column != "dirty" && column != "stale" &&
+            column != "status") {
+          std::cerr << "Error: Unknown column '" << column
+                    << "' (use name, type, branch, behind, dirty, stale, "
+                       "status)\n";
+          return 1;
+        }
+        g_columns.push_back(column);
+      }
+    } else if (arg == "--only") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --only requires behind, dirty or errors\n";
+        return 1;
+      }
+      g_onlyFilter = argv[++i];
+      if (g_onlyFilter != "behind" && g_onlyFilter != "dirty" &&
+          g_onlyFilter != "errors") {
+        std::cerr << "Error: --only must be behind, dirty or errors\n";
+        return 1;
+      }
+    } else if (arg == "--plan") {
+      g_plan = true;
+      g_reportOnly = true;
+      std::cout << "Plan mode enabled (nothing will be pulled)\n";
+    } else if (arg == "--staged") {
+      g_staged = true;
+    } else if (arg == "--wave-size") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --wave-size requires a number of repositories\n";
+        return 1;
+      }
+      if (!parseCount(argv[++i], g_waveSize)) {
+        std::cerr << "Error: --wave-size N must be between 1 and " << INT_MAX
+                  << "\n";
+        return 1;
+      }
+    } else if (arg == "--health-cmd") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --health-cmd requires a command\n";
+        return 1;
+      }
+      g_healthCommand = argv[++i];
+    } else if (arg == "--no-native") {
+      g_native = false;
+    } else if (arg == "--no-progress") {
+      g_progressDisplay = false;
+    } else if (arg == "--fingerprint") {
+      g_fingerprint = true;
+    } else if (arg == "--verify") {
+      g_verify = true;
+    } else if (arg == "--io-budget") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --io-budget requires a rate in MB/s\n";
+        return 1;
+      }
+      if (!parseCount(argv[++i], g_ioBudget)) {
+        std::cerr << "Error: --io-budget N must be between 1 and " << INT_MAX
+                  << "\n";
+        return 1;
+      }
+    } else if (arg == "--no-compat-check") {
+      g_compatCheck = false;
+    } else if (arg == "--update-strategy") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --update-strategy requires a strategy\n";
+        return 1;
+      }
+      g_updateStrategy = argv[++i];
+      if (g_updateStrategy != "pull" && g_updateStrategy != "autostash" &&
+          g_updateStrategy != "rebase") {
+        std::cerr << "Error: --update-strategy must be 'pull', 'autostash' "
+                     "or 'rebase'\n";
+        return 1;
+      }
+    } else if (arg == "--strategy-rules") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --strategy-rules requires a file argument\n";
+        return 1;
+      }
+      std::string rulesPath = argv[++i];
+      if (!loadRepoRules(rulesPath, g_strategyRules)) {
+        std::cerr << "Error: Could not read strategy rules file: "
+                  << rulesPath << "\n";
+        return 1;
+      }
+      for (const auto &rule : g_strategyRules) {
+        if (rule.second.size() != 1 ||
+            (rule.second[0] != "pull" && rule.second[0] != "autostash" &&
+             rule.second[0] != "rebase")) {
+          std::cerr << "Error: Invalid strategy for '" << rule.first
+                    << "' in " << rulesPath << "\n";
+          return 1;
+        }
+      }
+    } else if (arg == "--hedge") {
+      g_hedge = true;
+    } else if (arg == "--state-dir") {
+      if (i + 1 >= argc) {
+        std::cerr << "Error: --state-dir requires a directory argument\n";
+        return 1;
+      }
+      g_stateDir = argv[++i];
+    } else if (arg == "--notify") {
+      if (i + 2 >= argc) {
+        std::cerr << "Error: --notify requires SOCKET and REPO arguments\n";
+        std::cerr << "Usage: --notify <socket> <repo|path|url> [ref]\n";
+        return 1;
+      }
+      g_notifySocket = argv[++i];
+      g_notifyTarget = argv[++i];
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        g_notifyRef = argv[++i];
+      }
     } else if (arg == "--fox") {
       std::cout << "look at them!!  -->  🦊\n";
       return 0;
@@ -721,8 +7537,34 @@ int main(int argc, char *argv[]) {
       std::cout << "  -v, --verbose      Enable verbose output\n";
       std::cout
           << "  --report-only      Only report status, don't pull updates\n";
+      std::cout
+          << "  --read-only        Report only, and never write the index\n";
+      std::cout << "                     or take index.lock while scanning\n";
       std::cout << "  -y, --yes          Auto-confirm all pull prompts\n";
+      std::cout << "  --columns LIST     Only show (and only compute) these\n";
+      std::cout << "                     columns: name, type, branch,\n";
+      std::cout << "                     behind, dirty, stale (age of the\n";
+      std::cout << "                     oldest missing commit), status\n";
+      std::cout << "  --only FILTER      Only list repositories that are\n";
+      std::cout << "                     behind, dirty, or have errors\n";
+      std::cout << "  --no-progress      Don't show progress while checking\n";
+      std::cout << "  --no-native        Ask git for refs instead of reading\n";
+      std::cout << "                     them from .git directly\n";
+      std::cout << "  --shards N         Check repositories in N worker\n";
+      std::cout << "                     processes and merge the results\n";
+      std::cout << "                     (report-only unless --yes is used)\n";
       std::cout << "  --report-file FILE Save results and summary to a file\n";
+      std::cout << "  --metrics-file FILE\n";
+      std::cout << "                     Write per-repository behind counts\n";
+      std::cout << "                     and staleness in the Prometheus\n";
+      std::cout << "                     text format\n";
+      std::cout << "  --changelog [N]    List up to N incoming commits per\n";
+      std::cout
+          << "                     repository with updates (default 10)\n";
+      std::cout << "  --nested           Also check vendor/ and repositories\n";
+      std::cout << "                     nested inside extensions and skins\n";
+      std::cout << "  --scan-root DIR    Also search DIR (relative to PATH)\n";
+      std::cout << "                     for nested repositories\n";
       std::cout << "  --update TYPE NAME Update a specific extension or skin\n";
       std::cout << "                     TYPE must be 'core', 'extension', or "
                    "'skin'\n";
@@ -732,6 +7574,72 @@ int main(int argc, char *argv[]) {
       std::cout
           << "                       --update extension WikimediaEvents\n";
       std::cout << "                       --update skin Vector\n";
+      std::cout << "  --plan             Fetch, then list what an update\n";
+      std::cout << "                     would do and predict its wall time\n";
+      std::cout << "                     and critical path from past runs\n";
+      std::cout << "  --staged           Update core first, then extensions\n";
+      std::cout << "                     and skins in waves, stopping at the\n";
+      std::cout << "                     first failed fetch, pull or health\n";
+      std::cout << "                     check\n";
+      std::cout << "  --wave-size N      Repositories per wave (default 10)\n";
+      std::cout << "  --health-cmd CMD   With --staged, run CMD in the\n";
+      std::cout << "                     installation after core and after\n";
+      std::cout << "                     each wave that pulled something\n";
+      std::cout << "  --update-strategy STRATEGY\n";
+      std::cout << "                     How to pull: 'pull' (default),\n";
+      std::cout << "                     'autostash' (stash local changes,\n";
+      std::cout << "                     fast-forward, restore them) or\n";
+      std::cout << "                     'rebase' (also rebase local\n";
+      std::cout << "                     commits); conflicts roll back\n";
+      std::cout << "  --strategy-rules FILE\n";
+      std::cout << "                     Per-repository update strategies\n";
+      std::cout << "  --no-compat-check  Pull extension and skin updates\n";
+      std::cout << "                     even if they need a newer "
+                   "MediaWiki\n";
+      std::cout << "  --replicate-to PATH\n";
+      std::cout << "                     After pulling, copy the changes to\n";
+      std::cout << "                     the sibling install at PATH without\n";
+      std::cout
+          << "                     fetching from a remote (repeatable);\n";
+      std::cout << "                     exits 1 if any copy fails\n";
+      std::cout << "  --replicate-hardlinks\n";
+      std::cout << "                     Hard link replicated files that\n";
+      std::cout << "                     cannot be reflinked\n";
+      std::cout << "  --apply-sparse FILE\n";
+      std::cout << "                     Apply the sparse-checkout profiles\n";
+      std::cout << "                     in FILE and report the size and\n";
+      std::cout << "                     status time saved\n";
+      std::cout << "  --verify           Check packs and loose objects added\n";
+      std::cout << "                     since the last clean run for\n";
+      std::cout << "                     corruption\n";
+      std::cout << "  --io-budget MB     Read at most MB per second while\n";
+      std::cout << "                     verifying (default unlimited)\n";
+      std::cout << "  --fingerprint      Print a hash of every repository's\n";
+      std::cout << "                     HEAD, upstream and index, for cheap\n";
+      std::cout << "                     change detection by monitors\n";
+      std::cout << "  --migrate-remotes FILE\n";
+      std::cout << "                     Repoint origin remotes by the URL\n";
+      std::cout << "                     prefix rules in FILE, once the new\n";
+      std::cout << "                     remote has the upstream commit\n";
+      std::cout << "  --daemon           Keep running and sweep all\n";
+      std::cout << "                     repositories every --sweep-interval\n";
+      std::cout << "                     seconds (default 3600); report-only\n";
+      std::cout << "                     unless --yes is used\n";
+      std::cout << "  --listen SOCKET    With --daemon, accept change\n";
+      std::cout << "                     notifications on a Unix socket and\n";
+      std::cout << "                     refresh only the affected checkouts\n";
+      std::cout << "  --adaptive         Learn upstream commit rates and\n";
+      std::cout << "                     fetch busy repositories more often\n";
+      std::cout << "                     (per-repository schedule in daemon)\n";
+      std::cout << "  --fetch-budget N   With --adaptive, stay within N\n";
+      std::cout << "                     fetches per hour in total\n";
+      std::cout << "  --hedge            Start a second fetch when one runs\n";
+      std::cout << "                     past its host's usual p95 latency\n";
+      std::cout << "  --state-dir DIR    Where learned state is kept\n";
+      std::cout << "                     (default $XDG_STATE_HOME/local_mw)\n";
+      std::cout << "  --notify SOCKET REPO [REF]\n";
+      std::cout << "                     Send a change notification to a\n";
+      std::cout << "                     daemon; REPO is a name, path or URL\n";
       std::cout << "  -h, --help         Show this help message\n";
       std::cout << "  --version          Show version number\n\n";
       std::cout << "Arguments:\n";
@@ -763,6 +7671,33 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  if (g_readOnly) {
+    // These modes exist to write to the checkouts
+    const char *writer = g_updateMode                ? "--update"
+                         : !g_sparseProfile.empty()  ? "--apply-sparse"
+                         : !g_migrationRules.empty() ? "--migrate-remotes"
+                                                     : nullptr;
+    if (writer != nullptr) {
+      std::cerr << "Error: --read-only cannot be combined with " << writer
+                << "\n";
+      return 1;
+    }
+  }
+
+  if (!g_notifySocket.empty()) {
+    return sendNotification(g_notifySocket, g_notifyTarget, g_notifyRef);
+  }
+
+  if (g_stateDir.empty()) {
+    g_stateDir = defaultStateDir();
+  }
+
+  if (g_readOnly) {
+    // Stop `git status` and friends from refreshing the index (and taking
+    // index.lock to write it back) in every child process
+    setenv("GIT_OPTIONAL_LOCKS", "0", 1);
+  }
+
   // Get MediaWiki installation path if not provided
   if (mwPath.empty()) {
     std::cout << "Enter MediaWiki installation path: ";
@@ -786,11 +7721,62 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  if (g_fingerprint) {
+    return printFingerprint(basePath);
+  }
+
+  g_coreVersion = readCoreVersion(basePath);
+
   // Handle single repository update mode
   if (g_updateMode) {
     return updateSingleRepo(basePath, g_updateType, g_updateName);
   }
 
+  if (!g_sparseProfile.empty()) {
+    return applySparseProfiles(basePath, g_sparseProfile);
+  }
+
+  if (!g_migrationRules.empty()) {
+    return migrateRemotes(basePath, g_migrationRules);
+  }
+
+  if (g_daemon) {
+    // Nobody is there to answer prompts
+    g_reportOnly = g_reportOnly || !g_autoYes;
+    return runDaemon(basePath);
+  }
+
+  if (g_shards > 1) {
+    // Shard workers cannot share the terminal to prompt
+    g_reportOnly = g_reportOnly || !g_autoYes;
+  }
+
+  // Whether a report or action after the checks needs fetched refs
+  bool fetchNeededLater = !g_metricsFile.empty() || g_changelogLimit > 0 ||
+                          g_adaptive || g_hedge || g_verify ||
+                          !g_replicaPaths.empty();
+  if (!g_columns.empty()) {
+    auto wants = [](const std::string &column) {
+      return std::find(g_columns.begin(), g_columns.end(), column) !=
+             g_columns.end();
+    };
+    // Skip the fetch and the working tree scan unless something shown,
+    // filtered on or reported later needs them
+    g_needFetch = wants("behind") || wants("status") || wants("stale") ||
+                  g_onlyFilter == "behind" || fetchNeededLater;
+    // Pull prompts warn about uncommitted changes and a plan stashes them,
+    // whatever the table shows
+    g_needDirty = wants("dirty") || g_onlyFilter == "dirty" ||
+                  (g_needFetch && !g_reportOnly) || g_plan;
+    g_needStaleness = wants("stale") || !g_metricsFile.empty();
+  } else if (g_onlyFilter == "dirty") {
+    // Only repositories with uncommitted changes are listed, and finding
+    // those needs no fetch
+    g_needFetch = fetchNeededLater;
+  }
+  // Without a fetch there is nothing to pull
+  g_reportOnly = g_reportOnly || !g_needFetch;
+
   std::cout << "Checking MediaWiki installation at: " << basePath.string()
             << "\n";
   if (!g_reportOnly) {
@@ -798,24 +7784,39 @@ int main(int argc, char *argv[]) {
   }
   std::cout << "This may take a moment...\n";
 
-  // Check MediaWiki core (the base installation path)
-  std::cout << "Checking MediaWiki core...\n";
-  std::vector<RepoStatus> coreResults;
-  coreResults.push_back(checkRepository(basePath, "core"));
-
-  // Check extensions
-  fs::path extensionsPath = basePath / "extensions";
-  std::cout << "Checking extensions (" << countDirectories(extensionsPath)
-            << ")...\n";
-  printVerboseDirectoryHeader("extensions", extensionsPath);
+  // Collect every repository first, then check them all on one scheduler
+  std::vector<RepoTarget> targets = collectTargets(basePath, true);
+  std::vector<std::string> rollout;
+  // A plan checks everything at once; printPlan() models the waves
+  std::vector<RepoStatus> allResults =
+      g_staged && !g_plan ? runStagedRollout(basePath, targets, rollout)
+      : g_shards > 1      ? checkRepositoriesSharded(targets, g_shards)
+                          : checkRepositories(targets);
+  std::vector<RepoStatus> planResults;
+  if (g_plan) {
+    planResults = allResults;
+  }
+  if (!g_onlyFilter.empty()) {
+    allResults.erase(
+        std::remove_if(allResults.begin(), allResults.end(),
+                       [](const RepoStatus &status) {
+                         if (g_onlyFilter == "behind") {
+                           return !status.hasUpdates || status.pulled;
+                         }
+                         if (g_onlyFilter == "dirty") {
+                           return !status.hadUncommittedChanges;
+                         }
+                         return status.isRepo && status.error.empty() &&
+                                status.pullError.empty();
+                       }),
+        allResults.end());
+  }
+  std::vector<RepoStatus> coreResults = filterByType(allResults, {"core"});
   std::vector<RepoStatus> extensionResults =
-      scanDirectory(extensionsPath, "extension");
-
-  // Check skins
-  fs::path skinsPath = basePath / "skins";
-  std::cout << "Checking skins (" << countDirectories(skinsPath) << ")...\n";
-  printVerboseDirectoryHeader("skins", skinsPath);
-  std::vector<RepoStatus> skinResults = scanDirectory(skinsPath, "skin");
+      filterByType(allResults, {"extension"});
+  std::vector<RepoStatus> skinResults = filterByType(allResults, {"skin"});
+  std::vector<RepoStatus> nestedResults =
+      filterByType(allResults, {"vendor", "nested"});
 
   // Open report file if specified
   std::ofstream reportFile;
@@ -826,12 +7827,7 @@ int main(int argc, char *argv[]) {
                 << "\n";
     } else {
       // Write timestamp at the top of the report
-      std::time_t now = std::time(nullptr);
-      std::tm *localTime = std::localtime(&now);
-      char timeBuffer[20];
-      std::strftime(timeBuffer, sizeof(timeBuffer), "%Y-%m-%d %H:%M:%S",
-                    localTime);
-      reportFile << timeBuffer << "\n";
+      reportFile << currentTimestamp() << "\n";
     }
   }
   std::ofstream *reportStream = (reportFile.is_open()) ? &reportFile : nullptr;
@@ -844,26 +7840,74 @@ int main(int argc, char *argv[]) {
 
   printResultsSection("EXTENSIONS", extensionResults, reportStream);
   printResultsSection("SKINS", skinResults, reportStream);
+  if (g_nested) {
+    printResultsSection("NESTED REPOSITORIES", nestedResults, reportStream);
+  }
+
+  if (!rollout.empty()) {
+    std::ostringstream oss;
+    oss << "\nROLLOUT:\n";
+    for (const auto &line : rollout) {
+      oss << "  " << line << "\n";
+    }
+    writeOutput(oss.str(), reportStream);
+  }
+
+  if (g_changelogLimit > 0) {
+    printChangelog(allResults, reportStream);
+  }
+
+  if (g_columns.empty()) {
+    printStaleness(allResults, reportStream);
+  }
+
+  if (g_plan) {
+    printPlan(basePath, planResults, reportStream);
+  }
+
+  if (g_adaptive) {
+    assignFetchIntervals(allResults);
+    printFetchSchedule(allResults, reportStream);
+  }
+
+  if (g_hedge) {
+    printFetchLatency(reportStream);
+  }
+
+  int replicationFailures = 0;
+  if (!g_replicaPaths.empty()) {
+    replicationFailures = replicatePulls(basePath, allResults, reportStream);
+  }
 
   // Summary
-  Statistics coreStats = calculateStats(coreResults);
-  Statistics extensionStats = calculateStats(extensionResults);
-  Statistics skinStats = calculateStats(skinResults);
-
-  int totalRepos = static_cast<int>(
-      coreResults.size() + extensionResults.size() + skinResults.size());
-  int upToDate =
-      coreStats.upToDate + extensionStats.upToDate + skinStats.upToDate;
-  int hasUpdates =
-      coreStats.hasUpdates + extensionStats.hasUpdates + skinStats.hasUpdates;
-  int errors = coreStats.errors + extensionStats.errors + skinStats.errors;
+  Statistics stats = calculateStats(allResults);
 
   std::ostringstream summary;
   summary << "\nSUMMARY:\n";
-  summary << "  Total repositories: " << totalRepos << "\n";
-  summary << "  Up to date: " << upToDate << "\n";
-  summary << "  Updates available: " << hasUpdates << "\n";
-  summary << "  Errors/Warnings: " << errors << "\n\n";
+  summary << "  Total repositories: " << allResults.size() << "\n";
+  if (g_needFetch) {
+    summary << "  Up to date: " << stats.upToDate << "\n";
+    summary << "  Updates available: " << stats.hasUpdates << "\n";
+  }
+  if ((!g_columns.empty() || !g_needFetch) && g_needDirty) {
+    summary << "  With uncommitted changes: "
+            << std::count_if(allResults.begin(), allResults.end(),
+                             [](const RepoStatus &status) {
+                               return status.hadUncommittedChanges;
+                             })
+            << "\n";
+  }
+  summary << "  Errors/Warnings: " << stats.errors << "\n";
+  if (stats.locked > 0) {
+    summary << "  Locked by another git process: " << stats.locked << "\n";
+  }
+  if (g_verify) {
+    summary << "  Verified: " << g_verifiedPacks << " pack(s), "
+            << g_verifiedLooseObjects << " loose object(s), "
+            << formatBytes(g_verifiedBytes) << "\n";
+    summary << "  Corrupted: " << stats.corrupted << "\n";
+  }
+  summary << "\n";
   writeOutput(summary.str(), reportStream);
 
   if (reportFile.is_open()) {
@@ -871,5 +7915,11 @@ int main(int argc, char *argv[]) {
     std::cout << "Report saved to: " << g_reportFile << "\n";
   }
 
-  return 0;
+  if (!g_metricsFile.empty() && !writeMetricsFile(g_metricsFile, allResults)) {
+    std::cerr << "Warning: Could not write metrics file: " << g_metricsFile
+              << "\n";
+  }
+
+  // A replica left behind the primary must not look like a clean run
+  return replicationFailures > 0 ? 1 : 0;
 }